@@ -0,0 +1,185 @@
+#pragma once
+
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+
+// Define KARINA_ARENA_SCOPES to allow objects to be made in arenas, e.g.
+// for everything built while serving one request. Objects made while an
+// ArenaScope is the innermost one on the thread are bump-allocated from it
+// and not copy counted, and all of them go away along with the scope.
+// Whatever has to outlive the scope must be copied out with Escape() first;
+// copies of arena objects kept anywhere else are left dangling.
+#if defined(KARINA_ARENA_SCOPES)
+#   if defined(KARINA_MARK_SWEEP)
+#       error "arena scopes require copy counting"
+#   endif
+#endif
+
+
+#if defined(KARINA_ARENA_SCOPES)
+namespace Karina {
+
+class String;
+class Value;
+class ValueData;
+class WeakReference;
+
+
+class ArenaScope final
+{
+    ArenaScope(const ArenaScope &) = delete;
+    void operator=(const ArenaScope &) = delete;
+
+public:
+    // Copies the objects held by the value that belong to an arena, along
+    // with whatever they hold, to the heap.
+    inline static Value Escape(const Value &);
+
+    inline explicit ArenaScope();
+    inline ~ArenaScope();
+
+private:
+    static constexpr std::size_t kChunkSize = 1 << 16;
+
+    // Followed by the objects, up to end.
+    struct Chunk
+    {
+        Chunk *next;
+        char *end;
+    };
+
+    // Has objects made on the heap for as long as it lives, even from
+    // within a scope.
+    class Bypass final
+    {
+        Bypass(const Bypass &) = delete;
+        void operator=(const Bypass &) = delete;
+
+    public:
+        inline explicit Bypass();
+        inline ~Bypass();
+
+    private:
+        ArenaScope *const arenaScope_;
+    };
+
+    ArenaScope *const outer_;
+    Chunk *chunks_;
+    // The chunk objects are bump-allocated from, up to limit_.
+    Chunk *currentChunk_;
+    char *limit_;
+
+    inline static ArenaScope *&GetCurrent();
+    inline static void *Allocate(std::size_t);
+
+    inline void *allocate(std::size_t);
+    inline Chunk *addChunk(std::size_t);
+
+    // Defined along with ValueData.
+    inline void release();
+
+    friend String;
+    friend ValueData;
+    friend WeakReference;
+};
+
+
+ArenaScope::ArenaScope()
+  : outer_(GetCurrent()),
+    chunks_(nullptr),
+    currentChunk_(nullptr),
+    limit_(nullptr)
+{
+    GetCurrent() = this;
+}
+
+
+ArenaScope::~ArenaScope()
+{
+    assert(GetCurrent() == this);
+    GetCurrent() = outer_;
+    release();
+
+    while (chunks_ != nullptr) {
+        Chunk *chunk = chunks_;
+        chunks_ = chunk->next;
+        ::operator delete(chunk);
+    }
+}
+
+
+ArenaScope::Bypass::Bypass()
+  : arenaScope_(GetCurrent())
+{
+    GetCurrent() = nullptr;
+}
+
+
+ArenaScope::Bypass::~Bypass()
+{
+    GetCurrent() = arenaScope_;
+}
+
+
+ArenaScope *&
+ArenaScope::GetCurrent()
+{
+    static thread_local ArenaScope *current = nullptr;
+    return current;
+}
+
+
+void *
+ArenaScope::Allocate(std::size_t size)
+{
+    ArenaScope *arenaScope = GetCurrent();
+
+    if (arenaScope == nullptr) {
+        return nullptr;
+    } else {
+        return arenaScope->allocate(size);
+    }
+}
+
+
+void *
+ArenaScope::allocate(std::size_t size)
+{
+    std::size_t alignedSize = (size + 7) & ~static_cast<std::size_t>(7);
+    Chunk *chunk;
+
+    if (alignedSize > kChunkSize / 4) {
+        // Gets a chunk of its own, the current one may still have room.
+        chunk = addChunk(alignedSize);
+    } else {
+        if (currentChunk_ == nullptr
+            || alignedSize > static_cast<std::size_t>(limit_ - currentChunk_->end)) {
+            currentChunk_ = addChunk(kChunkSize);
+            limit_ = currentChunk_->end + kChunkSize;
+        }
+
+        chunk = currentChunk_;
+    }
+
+    void *block = chunk->end;
+    chunk->end += alignedSize;
+    return block;
+}
+
+
+ArenaScope::Chunk *
+ArenaScope::addChunk(std::size_t size)
+{
+    static_assert(sizeof(Chunk) % 8 == 0, "objects in chunks must stay aligned");
+    auto chunk = static_cast<Chunk *>(::operator new(sizeof(Chunk) + size));
+    chunk->next = chunks_;
+    chunk->end = reinterpret_cast<char *>(chunk + 1);
+    chunks_ = chunk;
+    return chunk;
+}
+
+} // namespace Karina
+#endif // defined(KARINA_ARENA_SCOPES)
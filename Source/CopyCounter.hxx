@@ -0,0 +1,569 @@
+#pragma once
+
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+// The copy counting policy of ValueData is picked at build time:
+//
+//   (default)                    NonatomicCopyCounter, values must not be
+//                                shared between threads.
+//   KARINA_ATOMIC_COPY_COUNTER   AtomicCopyCounter, every count is atomic.
+//   KARINA_HYBRID_COPY_COUNTER   HybridCopyCounter, counts are plain until
+//                                the value is shared, then atomic.
+//   KARINA_BIASED_COPY_COUNTER   BiasedCopyCounter, counts are plain on the
+//                                thread that created the object and atomic
+//                                on any other thread.
+#if defined(KARINA_ATOMIC_COPY_COUNTER) + defined(KARINA_HYBRID_COPY_COUNTER) \
+    + defined(KARINA_BIASED_COPY_COUNTER) > 1
+#   error "at most one copy counter may be selected"
+#endif
+
+
+namespace Karina {
+
+// Selects the constant constructor of a copy counter, for immortal objects
+// whose count is never touched.
+struct ImmortalTag
+{
+};
+
+
+// A copy counter counts the copies of an object beyond the first one.
+// decrement() returns true once the last copy is gone. share() returns true
+// if the object has just become shared, so that whatever it refers to has
+// to be shared as well. MergeQueued() is a safepoint hook for the counters
+// that need one.
+class NonatomicCopyCounter final
+{
+    NonatomicCopyCounter(const NonatomicCopyCounter &) = delete;
+    void operator=(const NonatomicCopyCounter &) = delete;
+
+public:
+    inline static void MergeQueued();
+
+    inline explicit NonatomicCopyCounter();
+    inline constexpr explicit NonatomicCopyCounter(ImmortalTag);
+
+    inline void increment();
+    inline bool decrement();
+    inline bool share();
+    // Only this counter is exact at any time, see CycleCollector.
+    inline int getCount() const;
+
+private:
+    int count_;
+};
+
+
+class AtomicCopyCounter final
+{
+    AtomicCopyCounter(const AtomicCopyCounter &) = delete;
+    void operator=(const AtomicCopyCounter &) = delete;
+
+public:
+    inline static void MergeQueued();
+
+    inline explicit AtomicCopyCounter();
+    inline constexpr explicit AtomicCopyCounter(ImmortalTag);
+
+    inline void increment();
+    inline bool decrement();
+    inline bool share();
+
+private:
+    std::atomic<int> count_;
+};
+
+
+// The lowest bit of the state says whether the object has been shared, the
+// rest is the count. An unshared object is only touched by the thread that
+// owns it, so its count is updated with plain loads and stores. share()
+// must be called by that thread before the object is handed to another one.
+class HybridCopyCounter final
+{
+    HybridCopyCounter(const HybridCopyCounter &) = delete;
+    void operator=(const HybridCopyCounter &) = delete;
+
+public:
+    inline static void MergeQueued();
+
+    inline explicit HybridCopyCounter();
+    inline constexpr explicit HybridCopyCounter(ImmortalTag);
+
+    inline void increment();
+    inline bool decrement();
+    inline bool share();
+
+private:
+    static constexpr unsigned int kSharedFlag = 1;
+    static constexpr unsigned int kOne = 2;
+
+    std::atomic<unsigned int> state_;
+};
+
+
+// Biased reference counting: the thread that created the object keeps a
+// plain biased count, every other thread goes through an atomic shared
+// count, and the two are merged once the biased count drops to zero.
+//
+// A release on another thread that would drive the shared count negative
+// while the owner still holds biased counts hands its copy over to the
+// owner's queue instead. The owner merges the counts and drops that copy at
+// its next MergeQueued() call or when it exits. Once the owner has exited,
+// this happens right away on the releasing thread. Owners are told apart by
+// ids that are never reused, so that the queue of a thread goes away with
+// it.
+class BiasedCopyCounter final
+{
+    BiasedCopyCounter(const BiasedCopyCounter &) = delete;
+    void operator=(const BiasedCopyCounter &) = delete;
+
+public:
+    inline static void MergeQueued();
+
+    inline explicit BiasedCopyCounter();
+    inline constexpr explicit BiasedCopyCounter(ImmortalTag);
+
+    inline void increment();
+    inline bool decrement();
+    inline bool share();
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::vector<BiasedCopyCounter *> copyCounters;
+    };
+
+    // The queues of the threads that are running, by owner id.
+    struct Registry
+    {
+        std::mutex mutex;
+        std::unordered_map<std::uint64_t, Queue *> queues;
+        std::uint64_t nextOwner;
+    };
+
+    class QueueHolder;
+
+    static constexpr int kMergedFlag = 1;
+    static constexpr int kQueuedFlag = 2;
+    static constexpr int kOne = 4;
+
+    // Zero for immortal objects.
+    const std::uint64_t owner_;
+    int biasedCount_;
+    std::atomic<int> sharedState_;
+
+    inline static QueueHolder &GetQueueHolder();
+    inline static Registry &GetRegistry();
+    inline static void MergeAll(std::vector<BiasedCopyCounter *> *);
+
+    // Frees the object holding the copy counter. Defined along with the
+    // holder.
+    inline static void Release(BiasedCopyCounter *);
+
+    inline bool isBiased() const;
+    inline bool enqueue();
+    inline bool merge();
+    inline bool mergeQueued();
+};
+
+
+class BiasedCopyCounter::QueueHolder final
+{
+    QueueHolder(const QueueHolder &) = delete;
+    void operator=(const QueueHolder &) = delete;
+
+public:
+    inline explicit QueueHolder();
+    inline ~QueueHolder();
+
+    inline std::uint64_t getOwner() const;
+    inline Queue *get();
+
+private:
+    std::uint64_t owner_;
+    Queue queue_;
+};
+
+
+#if defined(KARINA_ATOMIC_COPY_COUNTER)
+typedef AtomicCopyCounter CopyCounter;
+#elif defined(KARINA_HYBRID_COPY_COUNTER)
+typedef HybridCopyCounter CopyCounter;
+#elif defined(KARINA_BIASED_COPY_COUNTER)
+typedef BiasedCopyCounter CopyCounter;
+#else
+typedef NonatomicCopyCounter CopyCounter;
+#endif
+
+
+void
+NonatomicCopyCounter::MergeQueued()
+{
+}
+
+
+NonatomicCopyCounter::NonatomicCopyCounter()
+  : count_(0)
+{
+}
+
+
+constexpr
+NonatomicCopyCounter::NonatomicCopyCounter(ImmortalTag)
+  : count_(0)
+{
+}
+
+
+void
+NonatomicCopyCounter::increment()
+{
+    ++count_;
+}
+
+
+bool
+NonatomicCopyCounter::decrement()
+{
+    if (count_ == 0) {
+        return true;
+    } else {
+        --count_;
+        return false;
+    }
+}
+
+
+bool
+NonatomicCopyCounter::share()
+{
+    return false;
+}
+
+
+int
+NonatomicCopyCounter::getCount() const
+{
+    return count_;
+}
+
+
+void
+AtomicCopyCounter::MergeQueued()
+{
+}
+
+
+AtomicCopyCounter::AtomicCopyCounter()
+  : count_(0)
+{
+}
+
+
+constexpr
+AtomicCopyCounter::AtomicCopyCounter(ImmortalTag)
+  : count_(0)
+{
+}
+
+
+void
+AtomicCopyCounter::increment()
+{
+    count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+bool
+AtomicCopyCounter::decrement()
+{
+    if (count_.fetch_sub(1, std::memory_order_release) == 0) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    } else {
+        return false;
+    }
+}
+
+
+bool
+AtomicCopyCounter::share()
+{
+    return false;
+}
+
+
+void
+HybridCopyCounter::MergeQueued()
+{
+}
+
+
+HybridCopyCounter::HybridCopyCounter()
+  : state_(0)
+{
+}
+
+
+constexpr
+HybridCopyCounter::HybridCopyCounter(ImmortalTag)
+  : state_(0)
+{
+}
+
+
+void
+HybridCopyCounter::increment()
+{
+    unsigned int state = state_.load(std::memory_order_relaxed);
+
+    if ((state & kSharedFlag) == 0) {
+        state_.store(state + kOne, std::memory_order_relaxed);
+    } else {
+        state_.fetch_add(kOne, std::memory_order_relaxed);
+    }
+}
+
+
+bool
+HybridCopyCounter::decrement()
+{
+    unsigned int state = state_.load(std::memory_order_relaxed);
+
+    if ((state & kSharedFlag) == 0) {
+        if (state == 0) {
+            return true;
+        } else {
+            state_.store(state - kOne, std::memory_order_relaxed);
+            return false;
+        }
+    } else {
+        if (state_.fetch_sub(kOne, std::memory_order_release) < kOne) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return true;
+        } else {
+            return false;
+        }
+    }
+}
+
+
+bool
+HybridCopyCounter::share()
+{
+    return (state_.fetch_or(kSharedFlag, std::memory_order_relaxed) & kSharedFlag) == 0;
+}
+
+
+void
+BiasedCopyCounter::MergeQueued()
+{
+    Queue *queue = GetQueueHolder().get();
+    std::vector<BiasedCopyCounter *> copyCounters;
+
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        copyCounters.swap(queue->copyCounters);
+    }
+
+    MergeAll(&copyCounters);
+}
+
+
+BiasedCopyCounter::QueueHolder &
+BiasedCopyCounter::GetQueueHolder()
+{
+    static thread_local QueueHolder queueHolder;
+    return queueHolder;
+}
+
+
+BiasedCopyCounter::Registry &
+BiasedCopyCounter::GetRegistry()
+{
+    // Never destroyed, since threads may exit as late as they like.
+    static Registry *registry = new Registry{{}, {}, 1};
+    return *registry;
+}
+
+
+void
+BiasedCopyCounter::MergeAll(std::vector<BiasedCopyCounter *> *copyCounters)
+{
+    for (BiasedCopyCounter *copyCounter : *copyCounters) {
+        if (copyCounter->mergeQueued()) {
+            Release(copyCounter);
+        }
+    }
+}
+
+
+BiasedCopyCounter::BiasedCopyCounter()
+  : owner_(GetQueueHolder().getOwner()),
+    biasedCount_(1),
+    sharedState_(0)
+{
+}
+
+
+constexpr
+BiasedCopyCounter::BiasedCopyCounter(ImmortalTag)
+  : owner_(0),
+    biasedCount_(0),
+    sharedState_(0)
+{
+}
+
+
+void
+BiasedCopyCounter::increment()
+{
+    if (isBiased()) {
+        ++biasedCount_;
+    } else {
+        sharedState_.fetch_add(kOne, std::memory_order_relaxed);
+    }
+}
+
+
+bool
+BiasedCopyCounter::decrement()
+{
+    if (isBiased()) {
+        if (--biasedCount_ >= 1) {
+            return false;
+        } else {
+            return merge();
+        }
+    }
+
+    int sharedState = sharedState_.load(std::memory_order_relaxed);
+    int newSharedState;
+    bool isQueuing;
+
+    do {
+        isQueuing = (sharedState & (kMergedFlag | kQueuedFlag)) == 0 && sharedState < kOne;
+        newSharedState = isQueuing ? sharedState | kQueuedFlag : sharedState - kOne;
+    } while (!sharedState_.compare_exchange_weak(sharedState, newSharedState,
+                                                 std::memory_order_acq_rel,
+                                                 std::memory_order_relaxed));
+
+    if (isQueuing) {
+        return enqueue();
+    } else {
+        return (newSharedState & kMergedFlag) != 0 && newSharedState < kOne;
+    }
+}
+
+
+bool
+BiasedCopyCounter::share()
+{
+    return false;
+}
+
+
+bool
+BiasedCopyCounter::isBiased() const
+{
+    // biasedCount_ may only be read by the owner.
+    return owner_ == GetQueueHolder().getOwner() && biasedCount_ >= 1;
+}
+
+
+bool
+BiasedCopyCounter::enqueue()
+{
+    Registry &registry = GetRegistry();
+    std::unique_lock<std::mutex> registryLock(registry.mutex);
+    auto queue = registry.queues.find(owner_);
+
+    if (queue == registry.queues.end()) {
+        registryLock.unlock();
+        return mergeQueued();
+    }
+
+    // Held until pushed, so that the owner cannot drain the queue and go
+    // away in between.
+    std::lock_guard<std::mutex> lock(queue->second->mutex);
+    registryLock.unlock();
+    queue->second->copyCounters.push_back(this);
+    return false;
+}
+
+
+bool
+BiasedCopyCounter::merge()
+{
+    int delta = biasedCount_ * kOne + kMergedFlag;
+    biasedCount_ = 0;
+    return sharedState_.fetch_add(delta, std::memory_order_acq_rel) + delta < kOne;
+}
+
+
+bool
+BiasedCopyCounter::mergeQueued()
+{
+    // The queue holds a copy, so the merge itself cannot release the object.
+    if (biasedCount_ >= 1) {
+        merge();
+    }
+
+    return sharedState_.fetch_sub(kOne, std::memory_order_acq_rel) - kOne < kOne;
+}
+
+
+BiasedCopyCounter::QueueHolder::QueueHolder()
+{
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    owner_ = registry.nextOwner++;
+    registry.queues.emplace(owner_, &queue_);
+}
+
+
+BiasedCopyCounter::QueueHolder::~QueueHolder()
+{
+    {
+        Registry &registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.queues.erase(owner_);
+    }
+
+    // From here on its objects are released as those of any other exited
+    // thread, on this thread as well.
+    owner_ = 0;
+
+    std::vector<BiasedCopyCounter *> copyCounters;
+
+    {
+        // Waits for whoever found the queue before it was unregistered.
+        std::lock_guard<std::mutex> lock(queue_.mutex);
+        copyCounters.swap(queue_.copyCounters);
+    }
+
+    MergeAll(&copyCounters);
+}
+
+
+std::uint64_t
+BiasedCopyCounter::QueueHolder::getOwner() const
+{
+    return owner_;
+}
+
+
+BiasedCopyCounter::Queue *
+BiasedCopyCounter::QueueHolder::get()
+{
+    return &queue_;
+}
+
+} // namespace Karina
@@ -0,0 +1,126 @@
+#pragma once
+
+
+#include <cstddef>
+#include <vector>
+
+#include "CopyCounter.hxx"
+
+
+// Define KARINA_CYCLE_COLLECTOR to reclaim cycles of arrays, dictionaries
+// and closures, which copy counting alone leaks. Since the collector reads
+// exact copy counts, it only works with the nonatomic copy counter.
+#if defined(KARINA_CYCLE_COLLECTOR)
+#   if defined(KARINA_ATOMIC_COPY_COUNTER) || defined(KARINA_HYBRID_COPY_COUNTER) \
+       || defined(KARINA_BIASED_COPY_COUNTER)
+#       error "the cycle collector requires the nonatomic copy counter"
+#   endif
+#endif
+
+
+#if defined(KARINA_CYCLE_COLLECTOR)
+namespace Karina {
+
+class MemoryQuota;
+class ValueData;
+
+
+struct CycleCollectorStatistics
+{
+    std::size_t collectionCount;
+    std::size_t cycleCount;
+    std::size_t objectCount;
+    std::size_t byteCount;
+};
+
+
+// Synchronous trial deletion, one collector per thread. A container whose
+// copy count drops without reaching zero may be the last way into a cycle,
+// so it is buffered as a candidate, the buffer holding a copy of it.
+//
+// A collection first releases the candidates that only the buffer still
+// holds. Over what the others reach, it then subtracts the copies held by
+// the objects themselves from their copy counts, in a side table so that
+// the counts stay untouched. Whatever is left with no outside copies and
+// cannot be reached from an object that has any is garbage.
+//
+// Collections run on Collect() or, once the objects allocated since the
+// last one exceed the threshold, on the next allocation. A threshold of
+// zero turns the latter off.
+class CycleCollector final
+{
+    CycleCollector(const CycleCollector &) = delete;
+    void operator=(const CycleCollector &) = delete;
+
+public:
+    static constexpr std::size_t kDefaultThreshold = 1 << 20;
+
+    inline static CycleCollectorStatistics Collect();
+    inline static void SetThreshold(std::size_t);
+    // Totals over all collections on the calling thread.
+    inline static CycleCollectorStatistics GetStatistics();
+
+private:
+    std::vector<ValueData *> candidates_;
+    std::size_t threshold_;
+    std::size_t allocatedSize_;
+    bool isCollecting_;
+    CycleCollectorStatistics statistics_;
+
+    inline static CycleCollector *Get();
+
+    // Defined along with ValueData.
+    inline static void AddCandidate(ValueData *);
+    inline static void NotifyAllocation(std::size_t);
+
+    inline explicit CycleCollector();
+
+    // Defined along with ValueData.
+    inline CycleCollectorStatistics collect();
+
+#if defined(KARINA_MEMORY_QUOTA)
+    friend MemoryQuota;
+#endif
+    friend ValueData;
+};
+
+
+CycleCollectorStatistics
+CycleCollector::Collect()
+{
+    return Get()->collect();
+}
+
+
+void
+CycleCollector::SetThreshold(std::size_t threshold)
+{
+    Get()->threshold_ = threshold;
+}
+
+
+CycleCollectorStatistics
+CycleCollector::GetStatistics()
+{
+    return Get()->statistics_;
+}
+
+
+CycleCollector *
+CycleCollector::Get()
+{
+    static thread_local CycleCollector cycleCollector;
+    return &cycleCollector;
+}
+
+
+CycleCollector::CycleCollector()
+  : threshold_(kDefaultThreshold),
+    allocatedSize_(0),
+    isCollecting_(false),
+    statistics_{0, 0, 0, 0}
+{
+}
+
+} // namespace Karina
+#endif // defined(KARINA_CYCLE_COLLECTOR)
@@ -0,0 +1,405 @@
+#pragma once
+
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "Pool.hxx"
+
+
+// Define KARINA_MARK_SWEEP to have objects reclaimed by a precise mark-sweep
+// collector rather than by copy counting. Copies of values are then plain
+// word copies, and whatever is not reachable from a registered root, nor
+// from an immortal object, is freed on the next collection.
+//
+// Collections only run on Collect() or Poll(), which have to be called at
+// points where every live value is reachable from a root. Without
+// KARINA_MARK_SWEEP, roots are ignored and neither function does anything,
+// so that the same code runs in both modes.
+#if defined(KARINA_MARK_SWEEP)
+#   if defined(KARINA_ATOMIC_COPY_COUNTER) || defined(KARINA_HYBRID_COPY_COUNTER) \
+       || defined(KARINA_BIASED_COPY_COUNTER)
+#       error "the mark-sweep collector does not support threads sharing values"
+#   endif
+#   if defined(KARINA_CYCLE_COLLECTOR)
+#       error "the mark-sweep collector reclaims cycles already"
+#   endif
+#endif
+
+
+// Define KARINA_NURSERY as well to bump-allocate small objects in a nursery.
+// Poll() empties it once it is full, promoting whatever survives to the
+// old space in a Cheney-style copy. Arrays in the old space that may hold
+// young objects are kept in a remembered set, so array elements have to be
+// stored through Array::setElement(), the write barrier. References are
+// left as they are and must not point into young arrays.
+#if defined(KARINA_NURSERY)
+#   if !defined(KARINA_MARK_SWEEP)
+#       error "the nursery requires the mark-sweep collector"
+#   endif
+#endif
+
+
+// Define KARINA_INCREMENTAL_MARKING as well to spread the collections
+// started by Poll() over many calls, each of them taking about the pause
+// budget. Marking is snapshot-free: Value::operator=() carries a Dijkstra
+// barrier that shades whatever gets stored while marking, and objects made
+// meanwhile are shaded as well. Sweeping works on a detached object list.
+#if defined(KARINA_INCREMENTAL_MARKING)
+#   if !defined(KARINA_MARK_SWEEP)
+#       error "incremental marking requires the mark-sweep collector"
+#   endif
+#endif
+
+
+namespace Karina {
+
+class Array;
+class Heap;
+class MemoryQuota;
+class String;
+class Value;
+class ValueData;
+class WeakReference;
+
+
+struct GarbageCollectorStatistics
+{
+    std::size_t collectionCount;
+    std::size_t objectCount;
+    std::size_t byteCount;
+    std::size_t youngCollectionCount;
+    std::size_t promotedObjectCount;
+    std::size_t promotedByteCount;
+    std::size_t pauseCount;
+    std::chrono::nanoseconds pauseTime;
+    std::chrono::nanoseconds maxPauseTime;
+};
+
+
+// One heap per thread: objects are linked into the list of the thread that
+// made them and must not be handed to another one. Objects still in the
+// list when the thread exits are never freed.
+class GarbageCollector final
+{
+    GarbageCollector(const GarbageCollector &) = delete;
+    void operator=(const GarbageCollector &) = delete;
+
+public:
+    static constexpr std::size_t kDefaultThreshold = 1 << 22;
+    // In microseconds.
+    static constexpr std::chrono::microseconds::rep kDefaultPauseBudget = 1000;
+
+    // Registers the values in [values, values + length), e.g. globals or a
+    // VM stack whose unused slots are null.
+    inline static void AddRoots(Value *, std::size_t);
+    inline static void RemoveRoots(Value *);
+
+    // Empties the nursery if it is full, and collects if the old objects
+    // allocated since the last collection exceed the threshold.
+    inline static void Poll();
+    // Finishes the collection under way, if any, or runs a whole one.
+    inline static GarbageCollectorStatistics Collect();
+    inline static void SetThreshold(std::size_t);
+    inline static void SetPauseBudget(std::chrono::microseconds);
+    // Called with the length of every pause.
+    inline static void SetPauseListener(void (*)(std::chrono::nanoseconds));
+    // Totals over all collections on the calling thread.
+    inline static GarbageCollectorStatistics GetStatistics();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum class Phase
+    {
+        Idle,
+        Marking,
+        Sweeping,
+    };
+
+    static constexpr std::size_t kNurserySize = 1 << 18;
+    static constexpr std::size_t kMaxYoungSize = 512;
+    // Objects marked or swept between two looks at the clock.
+    static constexpr std::size_t kStepLength = 64;
+
+    std::vector<std::pair<Value *, std::size_t>> roots_;
+    ValueData *objects_;
+    std::size_t threshold_;
+    std::size_t allocatedSize_;
+    std::chrono::microseconds pauseBudget_;
+    void (*pauseListener_)(std::chrono::nanoseconds);
+    GarbageCollectorStatistics statistics_;
+    Phase phase_;
+    // Marked objects yet to be scanned.
+    std::vector<ValueData *> grayObjects_;
+    // Scanned slices of much longer strings, whose parents are left for
+    // finishMarking().
+    std::vector<String *> slices_;
+    // Objects yet to be swept, detached from objects_.
+    ValueData *unsweptObjects_;
+    // Of the collection under way.
+    std::size_t freedObjectCount_;
+    std::size_t freedByteCount_;
+#if defined(KARINA_NURSERY)
+    char *const nursery_;
+    char *nurseryTop_;
+    bool isNurseryFull_;
+    // Old arrays, concatenations and slices that may hold young objects.
+    std::vector<ValueData *> rememberedSet_;
+#endif
+
+    inline static GarbageCollector *Get();
+    inline static void *Allocate(std::size_t);
+    inline static bool IsYoung(const ValueData *);
+
+    // Defined along with ValueData.
+    inline static ValueData *Promote(ValueData *);
+    inline static void Remember(ValueData *);
+    inline static void WriteBarrier(ValueData *, const Value &);
+    inline static void MarkingBarrier(const Value &);
+
+    inline explicit GarbageCollector();
+
+    inline void step(Clock::time_point);
+    inline void recordPause(Clock::time_point);
+
+    // Defined along with ValueData.
+    inline GarbageCollectorStatistics collect();
+    inline void collectYoung();
+    inline void shade(ValueData *);
+    inline void startMarking();
+    inline bool mark(Clock::time_point);
+    inline void finishMarking();
+    inline bool sweep(Clock::time_point);
+
+    friend Array;
+    friend Heap;
+#if defined(KARINA_MEMORY_QUOTA)
+    friend MemoryQuota;
+#endif
+    friend String;
+    friend Value;
+    friend ValueData;
+    friend WeakReference;
+};
+
+
+void
+GarbageCollector::AddRoots(Value *values, std::size_t length)
+{
+#if defined(KARINA_MARK_SWEEP)
+    Get()->roots_.emplace_back(values, length);
+#else
+    static_cast<void>(values);
+    static_cast<void>(length);
+#endif
+}
+
+
+void
+GarbageCollector::RemoveRoots(Value *values)
+{
+#if defined(KARINA_MARK_SWEEP)
+    std::vector<std::pair<Value *, std::size_t>> &roots = Get()->roots_;
+
+    // Roots tend to go away in the reverse order they came.
+    for (std::size_t i = roots.size(); i >= 1; --i) {
+        if (roots[i - 1].first == values) {
+            roots.erase(roots.begin() + (i - 1));
+            return;
+        }
+    }
+
+    assert(false);
+#else
+    static_cast<void>(values);
+#endif
+}
+
+
+void
+GarbageCollector::Poll()
+{
+#if defined(KARINA_MARK_SWEEP)
+    GarbageCollector *garbageCollector = Get();
+    Clock::time_point start = Clock::now();
+    bool isPausing = false;
+
+#   if defined(KARINA_NURSERY)
+    if (garbageCollector->isNurseryFull_) {
+        garbageCollector->collectYoung();
+        isPausing = true;
+    }
+#   endif
+
+    if (garbageCollector->phase_ != Phase::Idle) {
+        garbageCollector->step(start + garbageCollector->pauseBudget_);
+        isPausing = true;
+    } else if (garbageCollector->threshold_ >= 1
+               && garbageCollector->allocatedSize_ >= garbageCollector->threshold_) {
+#   if defined(KARINA_INCREMENTAL_MARKING)
+        garbageCollector->startMarking();
+        garbageCollector->step(start + garbageCollector->pauseBudget_);
+#   else
+        garbageCollector->collect();
+#   endif
+        isPausing = true;
+    }
+
+    if (isPausing) {
+        garbageCollector->recordPause(start);
+    }
+#endif
+}
+
+
+GarbageCollectorStatistics
+GarbageCollector::Collect()
+{
+#if defined(KARINA_MARK_SWEEP)
+    GarbageCollector *garbageCollector = Get();
+    Clock::time_point start = Clock::now();
+    GarbageCollectorStatistics statistics = garbageCollector->collect();
+    garbageCollector->recordPause(start);
+    return statistics;
+#else
+    return GarbageCollectorStatistics();
+#endif
+}
+
+
+void
+GarbageCollector::SetThreshold(std::size_t threshold)
+{
+    Get()->threshold_ = threshold;
+}
+
+
+void
+GarbageCollector::SetPauseBudget(std::chrono::microseconds pauseBudget)
+{
+    Get()->pauseBudget_ = pauseBudget;
+}
+
+
+void
+GarbageCollector::SetPauseListener(void (*pauseListener)(std::chrono::nanoseconds))
+{
+    Get()->pauseListener_ = pauseListener;
+}
+
+
+GarbageCollectorStatistics
+GarbageCollector::GetStatistics()
+{
+    return Get()->statistics_;
+}
+
+
+GarbageCollector *
+GarbageCollector::Get()
+{
+    static thread_local GarbageCollector garbageCollector;
+    return &garbageCollector;
+}
+
+
+void *
+GarbageCollector::Allocate(std::size_t size)
+{
+    GarbageCollector *garbageCollector = Get();
+
+#if defined(KARINA_NURSERY)
+    std::size_t alignedSize = (size + 7) & ~static_cast<std::size_t>(7);
+
+    if (alignedSize <= kMaxYoungSize) {
+        if (alignedSize <= static_cast<std::size_t>(garbageCollector->nursery_ + kNurserySize
+                                                    - garbageCollector->nurseryTop_)) {
+            void *block = garbageCollector->nurseryTop_;
+            garbageCollector->nurseryTop_ += alignedSize;
+            return block;
+        } else {
+            garbageCollector->isNurseryFull_ = true;
+        }
+    }
+#endif
+
+    garbageCollector->allocatedSize_ += size;
+    return Pool::Allocate(size);
+}
+
+
+bool
+GarbageCollector::IsYoung(const ValueData *valueData)
+{
+#if defined(KARINA_NURSERY)
+    const GarbageCollector *garbageCollector = Get();
+    auto address = reinterpret_cast<std::uintptr_t>(valueData);
+    auto nursery = reinterpret_cast<std::uintptr_t>(garbageCollector->nursery_);
+    return address - nursery < kNurserySize;
+#else
+    static_cast<void>(valueData);
+    return false;
+#endif
+}
+
+
+GarbageCollector::GarbageCollector()
+  : objects_(nullptr),
+    threshold_(kDefaultThreshold),
+    allocatedSize_(0),
+    pauseBudget_(std::chrono::microseconds::rep(kDefaultPauseBudget)),
+    pauseListener_(nullptr),
+    statistics_(),
+    phase_(Phase::Idle),
+    unsweptObjects_(nullptr),
+    freedObjectCount_(0),
+    freedByteCount_(0)
+#if defined(KARINA_NURSERY)
+    , nursery_(static_cast<char *>(::operator new(kNurserySize))),
+    nurseryTop_(nursery_),
+    isNurseryFull_(false)
+#endif
+{
+}
+
+
+#if defined(KARINA_MARK_SWEEP)
+void
+GarbageCollector::step(Clock::time_point deadline)
+{
+    if (phase_ == Phase::Marking) {
+        if (!mark(deadline)) {
+            return;
+        }
+
+        finishMarking();
+    }
+
+    sweep(deadline);
+}
+
+
+void
+GarbageCollector::recordPause(Clock::time_point start)
+{
+    auto pauseTime = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    ++statistics_.pauseCount;
+    statistics_.pauseTime += pauseTime;
+
+    if (pauseTime > statistics_.maxPauseTime) {
+        statistics_.maxPauseTime = pauseTime;
+    }
+
+    if (pauseListener_ != nullptr) {
+        pauseListener_(pauseTime);
+    }
+}
+#endif // defined(KARINA_MARK_SWEEP)
+
+} // namespace Karina
@@ -0,0 +1,204 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+
+// Define KARINA_HEAP_STATISTICS to keep count of the strings, arrays,
+// dictionaries and closures alive on each thread and of the bytes they
+// take. Objects count as made when constructed and as dead once released,
+// whether by copy counting, a collector or their arena, so objects waiting
+// in the release queue are no longer live. Without it, the statistics do
+// not exist and nothing gets counted.
+
+
+namespace Karina {
+
+class ArenaScope;
+class Array;
+class Closure;
+class Dictionary;
+class GarbageCollector;
+class String;
+class Value;
+class ValueData;
+class WeakReference;
+
+
+#if defined(KARINA_HEAP_STATISTICS)
+struct HeapTypeStatistics
+{
+    std::size_t liveCount;
+    std::size_t liveByteCount;
+    std::size_t peakLiveCount;
+    std::size_t peakLiveByteCount;
+    // Allocation rates are the differences between two samples of these.
+    std::size_t allocationCount;
+    std::size_t allocatedByteCount;
+};
+
+
+struct HeapStatistics
+{
+    HeapTypeStatistics strings;
+    HeapTypeStatistics arrays;
+    HeapTypeStatistics dictionaries;
+    HeapTypeStatistics closures;
+    HeapTypeStatistics weakReferences;
+};
+#endif
+
+
+// The statistics are per thread. An object released on another thread than
+// the one that made it is counted as dead on the former, so live counts
+// only add up across threads and may wrap around on a single one.
+//
+// A snapshot is the magic "KHS1" followed by records, each starting with a
+// tag byte, with every number below an unsigned LEB128 varint:
+//
+//   kRootRecord     object id
+//   kObjectRecord   object id, type byte (string, array, dictionary,
+//                   closure or weak reference), flag byte
+//                   (kSnapshotImmortalFlag, kSnapshotRegionalFlag), size in
+//                   bytes, edge count, then for each edge the element index
+//                   (0 and 1 for the halves of a concatenation, 0 for the
+//                   string a slice is of) and object id
+//   kEndRecord
+//
+// Object ids count up from zero in the order the objects are found, and
+// every object found gets exactly one object record. Tools/AnalyzeHeapSnapshot
+// reads them.
+class Heap final
+{
+    Heap(const Heap &) = delete;
+    void operator=(const Heap &) = delete;
+
+public:
+    static constexpr unsigned char kEndRecord = 0;
+    static constexpr unsigned char kRootRecord = 1;
+    static constexpr unsigned char kObjectRecord = 2;
+    static constexpr unsigned char kSnapshotImmortalFlag = 1;
+    static constexpr unsigned char kSnapshotRegionalFlag = 2;
+
+#if defined(KARINA_HEAP_STATISTICS)
+    inline static HeapStatistics GetStatistics();
+    // As a JSON object keyed by type.
+    inline static std::string DumpStatistics();
+#endif
+    // Writes out everything reachable from the values in
+    // [roots, roots + rootCount) and, with KARINA_MARK_SWEEP, from the
+    // registered roots and the objects made immortal at run time, which are
+    // all written out as roots. Records go out as objects are visited, the
+    // walk only keeps an id per object. Returns false if the stream failed.
+    // Defined along with ValueData.
+    inline static bool WriteSnapshot(std::ostream &, const Value *, std::size_t);
+
+private:
+#if defined(KARINA_HEAP_STATISTICS)
+    // Indexed by ValueData::Type.
+    HeapTypeStatistics typeStatistics_[5];
+#endif
+
+    inline static void WriteVarint(std::ostream &, std::uint64_t);
+#if defined(KARINA_HEAP_STATISTICS)
+    inline static Heap *Get();
+    inline static void AppendTypeStatistics(std::string *, const char *,
+                                            const HeapTypeStatistics &);
+
+    // Defined along with ValueData.
+    inline static void NotifyMade(const ValueData *);
+    inline static void NotifyReleased(const ValueData *);
+#endif
+
+    inline explicit Heap();
+
+    friend ArenaScope;
+    friend Array;
+    friend Closure;
+    friend Dictionary;
+    friend GarbageCollector;
+    friend String;
+    friend ValueData;
+    friend WeakReference;
+};
+
+
+#if defined(KARINA_HEAP_STATISTICS)
+HeapStatistics
+Heap::GetStatistics()
+{
+    const HeapTypeStatistics *typeStatistics = Get()->typeStatistics_;
+    return {typeStatistics[0], typeStatistics[1], typeStatistics[2], typeStatistics[3],
+            typeStatistics[4]};
+}
+
+
+std::string
+Heap::DumpStatistics()
+{
+    HeapStatistics statistics = GetStatistics();
+    std::string json = "{";
+    AppendTypeStatistics(&json, "strings", statistics.strings);
+    json += ',';
+    AppendTypeStatistics(&json, "arrays", statistics.arrays);
+    json += ',';
+    AppendTypeStatistics(&json, "dictionaries", statistics.dictionaries);
+    json += ',';
+    AppendTypeStatistics(&json, "closures", statistics.closures);
+    json += ',';
+    AppendTypeStatistics(&json, "weakReferences", statistics.weakReferences);
+    json += '}';
+    return json;
+}
+#endif // defined(KARINA_HEAP_STATISTICS)
+
+
+void
+Heap::WriteVarint(std::ostream &stream, std::uint64_t x)
+{
+    while (x >= 0x80) {
+        stream.put(static_cast<char>((x & 0x7F) | 0x80));
+        x >>= 7;
+    }
+
+    stream.put(static_cast<char>(x));
+}
+
+
+#if defined(KARINA_HEAP_STATISTICS)
+Heap *
+Heap::Get()
+{
+    static thread_local Heap heap;
+    return &heap;
+}
+
+
+void
+Heap::AppendTypeStatistics(std::string *json, const char *name,
+                           const HeapTypeStatistics &typeStatistics)
+{
+    *json += '"';
+    *json += name;
+    *json += "\":{\"liveCount\":" + std::to_string(typeStatistics.liveCount)
+             + ",\"liveByteCount\":" + std::to_string(typeStatistics.liveByteCount)
+             + ",\"peakLiveCount\":" + std::to_string(typeStatistics.peakLiveCount)
+             + ",\"peakLiveByteCount\":" + std::to_string(typeStatistics.peakLiveByteCount)
+             + ",\"allocationCount\":" + std::to_string(typeStatistics.allocationCount)
+             + ",\"allocatedByteCount\":" + std::to_string(typeStatistics.allocatedByteCount)
+             + '}';
+}
+#endif // defined(KARINA_HEAP_STATISTICS)
+
+
+Heap::Heap()
+#if defined(KARINA_HEAP_STATISTICS)
+  : typeStatistics_()
+#endif
+{
+}
+
+} // namespace Karina
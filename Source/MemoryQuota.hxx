@@ -0,0 +1,203 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+
+// Define KARINA_MEMORY_QUOTA to cap the bytes of objects alive on each
+// thread, so that one runaway script cannot take the whole process down.
+// Objects are charged when allocated and credited once freed, young and
+// arena objects included.
+//
+// Going over the soft limit first drains the release queue and runs the
+// cycle collector, if built in, or has the next GarbageCollector::Poll()
+// collect unless its threshold is zero, and then calls the listener, which
+// may evict caches. Objects that would go over the hard limit are not made,
+// OutOfMemory is thrown instead, for the interpreter to turn into a script
+// error. Both limits are off by default.
+
+
+#if defined(KARINA_MEMORY_QUOTA)
+namespace Karina {
+
+class ArenaScope;
+class Array;
+class GarbageCollector;
+class String;
+class ValueData;
+
+
+class OutOfMemory final : public std::exception
+{
+public:
+    inline explicit OutOfMemory(std::size_t, std::size_t, std::size_t);
+
+    inline const char *what() const noexcept override;
+
+    inline std::size_t getRequestedSize() const;
+    inline std::size_t getUsedSize() const;
+    inline std::size_t getHardLimit() const;
+
+private:
+    std::size_t requestedSize_;
+    std::size_t usedSize_;
+    std::size_t hardLimit_;
+};
+
+
+// One quota per thread. An object freed on another thread than the one
+// that made it is credited to the former, so the used sizes only add up
+// across threads.
+class MemoryQuota final
+{
+    MemoryQuota(const MemoryQuota &) = delete;
+    void operator=(const MemoryQuota &) = delete;
+
+public:
+    // Soft first, then hard. SIZE_MAX turns either off.
+    inline static void SetLimits(std::size_t, std::size_t);
+    // Called with the used size once it goes over the soft limit, and then
+    // again only after it has fallen under three quarters of it.
+    inline static void SetSoftLimitListener(void (*)(std::size_t));
+    inline static std::size_t GetUsedSize();
+
+private:
+    std::size_t usedSize_;
+    std::size_t softLimit_;
+    std::size_t hardLimit_;
+    void (*softLimitListener_)(std::size_t);
+    bool isOverSoftLimit_;
+
+    inline static MemoryQuota *Get();
+    inline static void Charge(std::size_t);
+    inline static void Credit(std::size_t);
+
+    inline explicit MemoryQuota();
+
+    // Defined along with ValueData.
+    inline void reclaim();
+
+    friend ArenaScope;
+    friend Array;
+    friend GarbageCollector;
+    friend String;
+    friend ValueData;
+};
+
+
+OutOfMemory::OutOfMemory(std::size_t requestedSize, std::size_t usedSize,
+                         std::size_t hardLimit)
+  : requestedSize_(requestedSize),
+    usedSize_(usedSize),
+    hardLimit_(hardLimit)
+{
+}
+
+
+const char *
+OutOfMemory::what() const noexcept
+{
+    return "memory quota exceeded";
+}
+
+
+std::size_t
+OutOfMemory::getRequestedSize() const
+{
+    return requestedSize_;
+}
+
+
+std::size_t
+OutOfMemory::getUsedSize() const
+{
+    return usedSize_;
+}
+
+
+std::size_t
+OutOfMemory::getHardLimit() const
+{
+    return hardLimit_;
+}
+
+
+void
+MemoryQuota::SetLimits(std::size_t softLimit, std::size_t hardLimit)
+{
+    MemoryQuota *memoryQuota = Get();
+    memoryQuota->softLimit_ = softLimit;
+    memoryQuota->hardLimit_ = hardLimit;
+    memoryQuota->isOverSoftLimit_ = memoryQuota->usedSize_ > softLimit;
+}
+
+
+void
+MemoryQuota::SetSoftLimitListener(void (*softLimitListener)(std::size_t))
+{
+    Get()->softLimitListener_ = softLimitListener;
+}
+
+
+std::size_t
+MemoryQuota::GetUsedSize()
+{
+    return Get()->usedSize_;
+}
+
+
+MemoryQuota *
+MemoryQuota::Get()
+{
+    static thread_local MemoryQuota memoryQuota;
+    return &memoryQuota;
+}
+
+
+void
+MemoryQuota::Charge(std::size_t size)
+{
+    MemoryQuota *memoryQuota = Get();
+
+    // Unless over the soft limit already, the used size is under it.
+    if (!memoryQuota->isOverSoftLimit_
+        && size > memoryQuota->softLimit_ - memoryQuota->usedSize_) {
+        memoryQuota->isOverSoftLimit_ = true;
+        memoryQuota->reclaim();
+    }
+
+    if (memoryQuota->usedSize_ > memoryQuota->hardLimit_
+        || size > memoryQuota->hardLimit_ - memoryQuota->usedSize_) {
+        throw OutOfMemory(size, memoryQuota->usedSize_, memoryQuota->hardLimit_);
+    }
+
+    memoryQuota->usedSize_ += size;
+}
+
+
+void
+MemoryQuota::Credit(std::size_t size)
+{
+    MemoryQuota *memoryQuota = Get();
+    memoryQuota->usedSize_ -= size;
+
+    // Some slack, lest every allocation around the limit set off a collection.
+    if (memoryQuota->usedSize_ <= memoryQuota->softLimit_ - memoryQuota->softLimit_ / 4) {
+        memoryQuota->isOverSoftLimit_ = false;
+    }
+}
+
+
+MemoryQuota::MemoryQuota()
+  : usedSize_(0),
+    softLimit_(SIZE_MAX),
+    hardLimit_(SIZE_MAX),
+    softLimitListener_(nullptr),
+    isOverSoftLimit_(false)
+{
+}
+
+} // namespace Karina
+#endif // defined(KARINA_MEMORY_QUOTA)
@@ -0,0 +1,270 @@
+#pragma once
+
+
+#include <cassert>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+
+namespace Karina {
+
+struct PoolStatistics
+{
+    std::size_t blockSize;
+    std::size_t chunkCount;
+    std::size_t blockCount;
+    std::size_t freeBlockCount;
+};
+
+
+// Size-classed free lists of fixed-size blocks, one set per thread. A block
+// freed on another thread than the one that allocated it simply joins the
+// free list of the former, so the statistics are per thread and only add
+// up across threads. Chunks are never given back to the system: those of a
+// thread that exits are left, along with its free blocks, to the next
+// thread that runs out of blocks of that size.
+class Pool final
+{
+    Pool(const Pool &) = delete;
+    void operator=(const Pool &) = delete;
+
+public:
+    static constexpr std::size_t kSizeClassCount = 32;
+    static constexpr std::size_t kMaxBlockSize = 16 * kSizeClassCount;
+
+    inline static void *Allocate(std::size_t);
+    inline static void Free(void *, std::size_t);
+    inline static PoolStatistics GetStatistics(std::size_t);
+
+private:
+    static constexpr std::size_t kChunkSize = 16384;
+
+    struct Block
+    {
+        Block *next;
+    };
+
+    // Heads each chunk, padded so that the blocks stay aligned.
+    struct alignas(16) Chunk
+    {
+        Chunk *next;
+    };
+
+    // What the pools of exited threads left behind, for one size class.
+    struct Orphans
+    {
+        std::mutex mutex;
+        Pool *pool;
+    };
+
+    std::size_t blockSize_;
+    Block *freeBlocks_;
+    char *nextBlock_;
+    char *chunkEnd_;
+    Chunk *chunks_;
+    std::size_t chunkCount_;
+    std::size_t blockCount_;
+    std::size_t freeBlockCount_;
+
+    inline static Pool *Get(std::size_t);
+    inline static Orphans &GetOrphans(std::size_t);
+
+    inline explicit Pool();
+    inline ~Pool();
+
+    inline void *allocateBlock();
+    inline void freeBlock(void *);
+    inline void addChunk();
+    // Moves the chunks and free blocks of the other pool to this one.
+    inline void adopt(Pool *);
+};
+
+
+void *
+Pool::Allocate(std::size_t size)
+{
+    assert(size >= 1);
+
+    if (size > kMaxBlockSize) {
+        return ::operator new(size);
+    } else {
+        return Get((size - 1) / 16)->allocateBlock();
+    }
+}
+
+
+void
+Pool::Free(void *block, std::size_t size)
+{
+    assert(size >= 1);
+
+    if (size > kMaxBlockSize) {
+        ::operator delete(block);
+    } else {
+        Get((size - 1) / 16)->freeBlock(block);
+    }
+}
+
+
+PoolStatistics
+Pool::GetStatistics(std::size_t sizeClass)
+{
+    assert(sizeClass < kSizeClassCount);
+    const Pool *pool = Get(sizeClass);
+    return {pool->blockSize_, pool->chunkCount_, pool->blockCount_, pool->freeBlockCount_};
+}
+
+
+Pool *
+Pool::Get(std::size_t sizeClass)
+{
+    static thread_local Pool pools[kSizeClassCount];
+    Pool *pool = &pools[sizeClass];
+
+    if (pool->blockSize_ == 0) {
+        pool->blockSize_ = 16 * (sizeClass + 1);
+    }
+
+    return pool;
+}
+
+
+Pool::Orphans &
+Pool::GetOrphans(std::size_t sizeClass)
+{
+    // Never destroyed, since threads may exit as late as they like.
+    static Orphans *orphans = new Orphans[kSizeClassCount]();
+    return orphans[sizeClass];
+}
+
+
+Pool::Pool()
+  : blockSize_(0),
+    freeBlocks_(nullptr),
+    nextBlock_(nullptr),
+    chunkEnd_(nullptr),
+    chunks_(nullptr),
+    chunkCount_(0),
+    blockCount_(0),
+    freeBlockCount_(0)
+{
+}
+
+
+Pool::~Pool()
+{
+    if (chunks_ == nullptr) {
+        return;
+    }
+
+    // Whatever is left of the current chunk is carved up as well.
+    while (nextBlock_ != chunkEnd_) {
+        freeBlock(nextBlock_);
+        nextBlock_ += blockSize_;
+        ++blockCount_;
+    }
+
+    Orphans &orphans = GetOrphans(blockSize_ / 16 - 1);
+    std::lock_guard<std::mutex> lock(orphans.mutex);
+
+    if (orphans.pool == nullptr) {
+        orphans.pool = new Pool();
+        orphans.pool->blockSize_ = blockSize_;
+    }
+
+    orphans.pool->adopt(this);
+}
+
+
+void *
+Pool::allocateBlock()
+{
+    if (freeBlocks_ != nullptr) {
+        Block *block = freeBlocks_;
+        freeBlocks_ = block->next;
+        --freeBlockCount_;
+        return block;
+    } else {
+        if (nextBlock_ == chunkEnd_) {
+            Orphans &orphans = GetOrphans(blockSize_ / 16 - 1);
+            std::unique_lock<std::mutex> lock(orphans.mutex);
+
+            if (orphans.pool != nullptr && orphans.pool->chunks_ != nullptr) {
+                adopt(orphans.pool);
+                lock.unlock();
+                return allocateBlock();
+            }
+
+            lock.unlock();
+            addChunk();
+        }
+
+        void *block = nextBlock_;
+        nextBlock_ += blockSize_;
+        ++blockCount_;
+        return block;
+    }
+}
+
+
+void
+Pool::freeBlock(void *block)
+{
+    freeBlocks_ = new (block) Block{freeBlocks_};
+    ++freeBlockCount_;
+}
+
+
+void
+Pool::addChunk()
+{
+    chunks_ = new (::operator new(kChunkSize)) Chunk{chunks_};
+    nextBlock_ = reinterpret_cast<char *>(chunks_ + 1);
+    chunkEnd_ = nextBlock_ + (kChunkSize - sizeof(Chunk)) / blockSize_ * blockSize_;
+    ++chunkCount_;
+}
+
+
+void
+Pool::adopt(Pool *other)
+{
+    assert(other->blockSize_ == blockSize_ && other->nextBlock_ == other->chunkEnd_);
+
+    if (other->chunks_ == nullptr) {
+        return;
+    }
+
+    Chunk *lastChunk = other->chunks_;
+
+    while (lastChunk->next != nullptr) {
+        lastChunk = lastChunk->next;
+    }
+
+    lastChunk->next = chunks_;
+    chunks_ = other->chunks_;
+
+    if (freeBlocks_ == nullptr) {
+        freeBlocks_ = other->freeBlocks_;
+    } else if (other->freeBlocks_ != nullptr) {
+        Block *lastBlock = other->freeBlocks_;
+
+        while (lastBlock->next != nullptr) {
+            lastBlock = lastBlock->next;
+        }
+
+        lastBlock->next = freeBlocks_;
+        freeBlocks_ = other->freeBlocks_;
+    }
+
+    chunkCount_ += other->chunkCount_;
+    blockCount_ += other->blockCount_;
+    freeBlockCount_ += other->freeBlockCount_;
+    other->freeBlocks_ = nullptr;
+    other->chunks_ = nullptr;
+    other->chunkCount_ = 0;
+    other->blockCount_ = 0;
+    other->freeBlockCount_ = 0;
+}
+
+} // namespace Karina
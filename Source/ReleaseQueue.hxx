@@ -0,0 +1,104 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// Define KARINA_DEFERRED_RELEASE to have dead arrays, dictionaries and
+// closures queued rather than released on the spot, so that dropping the
+// last copy of a large structure takes constant time and releasing deeply
+// nested data cannot run out of stack. Every release then works off a few
+// elements of the queue, and Drain() works off more at safepoints.
+#if defined(KARINA_DEFERRED_RELEASE)
+#   if defined(KARINA_MARK_SWEEP)
+#       error "the mark-sweep collector releases nothing on the spot"
+#   endif
+#endif
+
+
+#if defined(KARINA_DEFERRED_RELEASE)
+namespace Karina {
+
+class ValueData;
+
+
+// One queue per thread, holding whatever was released on it.
+class ReleaseQueue final
+{
+    ReleaseQueue(const ReleaseQueue &) = delete;
+    void operator=(const ReleaseQueue &) = delete;
+
+public:
+    static constexpr std::size_t kDefaultBudget = 16;
+
+    // Destroys up to that many elements or objects. Returns true once the
+    // queue is empty.
+    inline static bool Drain(std::size_t = SIZE_MAX);
+    // Sets how much every release works off, zero leaves it all to Drain().
+    inline static void SetBudget(std::size_t);
+    inline static std::size_t GetLength();
+
+private:
+    struct Entry
+    {
+        ValueData *valueData;
+        // The next element to destroy.
+        std::size_t index;
+    };
+
+    // A stack, so that the children of an object go before the rest of it.
+    std::vector<Entry> entries_;
+    std::size_t budget_;
+    bool isDraining_;
+
+    inline static ReleaseQueue *Get();
+
+    inline ~ReleaseQueue();
+
+    // Defined along with ValueData.
+    inline explicit ReleaseQueue();
+    inline void push(ValueData *);
+    inline bool drain(std::size_t);
+
+    friend ValueData;
+};
+
+
+bool
+ReleaseQueue::Drain(std::size_t budget)
+{
+    return Get()->drain(budget);
+}
+
+
+void
+ReleaseQueue::SetBudget(std::size_t budget)
+{
+    Get()->budget_ = budget;
+}
+
+
+std::size_t
+ReleaseQueue::GetLength()
+{
+    return Get()->entries_.size();
+}
+
+
+ReleaseQueue *
+ReleaseQueue::Get()
+{
+    static thread_local ReleaseQueue releaseQueue;
+    return &releaseQueue;
+}
+
+
+ReleaseQueue::~ReleaseQueue()
+{
+    drain(SIZE_MAX);
+}
+
+} // namespace Karina
+#endif // defined(KARINA_DEFERRED_RELEASE)
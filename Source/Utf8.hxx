@@ -0,0 +1,447 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#   include <immintrin.h>
+#endif
+
+
+// Strings hold bytes, which are classified as ASCII, UTF-8 or neither in one
+// pass. With AVX2 or SSE4.1 enabled at compile time, e.g. by -march=native,
+// whole vectors are checked at once with the lookup algorithm of Keiser and
+// Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+// Otherwise words of ASCII are skipped and the rest is checked byte by byte.
+
+
+namespace Karina {
+
+enum class Encoding
+{
+    Ascii,
+    Utf8,
+    Binary,
+};
+
+
+class Utf8 final
+{
+    Utf8(const Utf8 &) = delete;
+    void operator=(const Utf8 &) = delete;
+
+public:
+    inline static Encoding Classify(const char *, std::size_t);
+    // Byte by byte, for constants classified at compile time.
+    inline static constexpr Encoding ClassifyConstant(const char *, std::size_t);
+    // The characters must be valid UTF-8 for both.
+    inline static std::size_t CountCodepoints(const char *, std::size_t);
+    // Returns the offset of the codepoint that many after the one at the
+    // offset.
+    inline static std::size_t Skip(const char *, std::size_t, std::size_t);
+
+private:
+    static constexpr std::uint64_t kHighBits = UINT64_C(0x8080808080808080);
+
+#if defined(__AVX2__)
+    struct Avx2;
+#elif defined(__SSE4_1__)
+    struct Sse41;
+#endif
+
+    // Returns the length of the sequence starting with a non-ASCII byte at
+    // the offset, or 0 if it is not valid UTF-8.
+    inline static constexpr std::size_t GetSequenceLength(const char *, std::size_t,
+                                                          std::size_t);
+    inline static Encoding ClassifyBytes(const char *, std::size_t);
+    template<class Vectors>
+    inline static Encoding ClassifyVectors(const char *, std::size_t);
+    // Returns the errors found in the vector, which follows the previous one.
+    template<class Vectors>
+    inline static typename Vectors::Vector CheckVector(typename Vectors::Vector,
+                                                       typename Vectors::Vector);
+};
+
+
+#if defined(__AVX2__)
+struct Utf8::Avx2
+{
+    typedef __m256i Vector;
+
+    static Vector Load(const char *bytes)
+    {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes));
+    }
+
+    static Vector Splat(unsigned char byte)
+    {
+        return _mm256_set1_epi8(static_cast<char>(byte));
+    }
+
+    static Vector Lookup(const unsigned char (&table)[16], Vector indices)
+    {
+        __m128i lane = _mm_loadu_si128(reinterpret_cast<const __m128i *>(table));
+        return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(lane), indices);
+    }
+
+    // The high nibble of each byte.
+    static Vector ShiftRight4(Vector vector)
+    {
+        return _mm256_and_si256(_mm256_srli_epi16(vector, 4), Splat(0x0F));
+    }
+
+    // The vector shifted by N bytes, with the last N of the previous one
+    // shifted in.
+    template<int N>
+    static Vector Shift(Vector vector, Vector previous)
+    {
+        return _mm256_alignr_epi8(vector, _mm256_permute2x128_si256(previous, vector, 0x21),
+                                  16 - N);
+    }
+
+    static Vector And(Vector left, Vector right) { return _mm256_and_si256(left, right); }
+    static Vector Or(Vector left, Vector right) { return _mm256_or_si256(left, right); }
+    static Vector Xor(Vector left, Vector right) { return _mm256_xor_si256(left, right); }
+    static Vector SubtractSaturated(Vector left, Vector right) { return _mm256_subs_epu8(left, right); }
+    static bool IsAscii(Vector vector) { return _mm256_movemask_epi8(vector) == 0; }
+    static bool IsZero(Vector vector) { return _mm256_testz_si256(vector, vector) != 0; }
+};
+#elif defined(__SSE4_1__)
+struct Utf8::Sse41
+{
+    typedef __m128i Vector;
+
+    static Vector Load(const char *bytes)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+    }
+
+    static Vector Splat(unsigned char byte)
+    {
+        return _mm_set1_epi8(static_cast<char>(byte));
+    }
+
+    static Vector Lookup(const unsigned char (&table)[16], Vector indices)
+    {
+        return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table)), indices);
+    }
+
+    // The high nibble of each byte.
+    static Vector ShiftRight4(Vector vector)
+    {
+        return _mm_and_si128(_mm_srli_epi16(vector, 4), Splat(0x0F));
+    }
+
+    // The vector shifted by N bytes, with the last N of the previous one
+    // shifted in.
+    template<int N>
+    static Vector Shift(Vector vector, Vector previous)
+    {
+        return _mm_alignr_epi8(vector, previous, 16 - N);
+    }
+
+    static Vector And(Vector left, Vector right) { return _mm_and_si128(left, right); }
+    static Vector Or(Vector left, Vector right) { return _mm_or_si128(left, right); }
+    static Vector Xor(Vector left, Vector right) { return _mm_xor_si128(left, right); }
+    static Vector SubtractSaturated(Vector left, Vector right) { return _mm_subs_epu8(left, right); }
+    static bool IsAscii(Vector vector) { return _mm_movemask_epi8(vector) == 0; }
+    static bool IsZero(Vector vector) { return _mm_testz_si128(vector, vector) != 0; }
+};
+#endif
+
+
+Encoding
+Utf8::Classify(const char *characters, std::size_t length)
+{
+#if defined(__AVX2__)
+    return ClassifyVectors<Avx2>(characters, length);
+#elif defined(__SSE4_1__)
+    return ClassifyVectors<Sse41>(characters, length);
+#else
+    return ClassifyBytes(characters, length);
+#endif
+}
+
+
+std::size_t
+Utf8::CountCodepoints(const char *characters, std::size_t length)
+{
+    std::size_t count = length;
+    std::size_t i = 0;
+
+    // Subtracts the continuation bytes, 10xxxxxx, a word at a time.
+    for (; i + 8 <= length; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, characters + i, 8);
+        std::uint64_t continuations = (word & ~(word << 1) & kHighBits) >> 7;
+        count -= static_cast<std::size_t>((continuations * UINT64_C(0x0101010101010101)) >> 56);
+    }
+
+    for (; i < length; ++i) {
+        if ((static_cast<unsigned char>(characters[i]) & 0xC0) == 0x80) {
+            --count;
+        }
+    }
+
+    return count;
+}
+
+
+std::size_t
+Utf8::Skip(const char *characters, std::size_t offset, std::size_t count)
+{
+    // By the high nibble of the leading byte.
+    static const unsigned char sequenceLengths[16] = {
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4,
+    };
+
+    for (std::size_t i = 0; i < count; ++i) {
+        offset += sequenceLengths[static_cast<unsigned char>(characters[offset]) >> 4];
+    }
+
+    return offset;
+}
+
+
+constexpr
+Encoding
+Utf8::ClassifyConstant(const char *characters, std::size_t length)
+{
+    bool isAscii = true;
+    std::size_t i = 0;
+
+    while (i < length) {
+        if (static_cast<unsigned char>(characters[i]) < 0x80) {
+            ++i;
+            continue;
+        }
+
+        isAscii = false;
+        std::size_t sequenceLength = GetSequenceLength(characters, length, i);
+
+        if (sequenceLength == 0) {
+            return Encoding::Binary;
+        }
+
+        i += sequenceLength;
+    }
+
+    return isAscii ? Encoding::Ascii : Encoding::Utf8;
+}
+
+
+constexpr
+std::size_t
+Utf8::GetSequenceLength(const char *characters, std::size_t length, std::size_t offset)
+{
+    auto byte = static_cast<unsigned char>(characters[offset]);
+    std::size_t sequenceLength = 0;
+    // Of the second byte, which rules out overlong forms, surrogates and
+    // codepoints past U+10FFFF.
+    unsigned char min = 0x80;
+    unsigned char max = 0xBF;
+
+    if (byte >= 0xC2 && byte <= 0xDF) {
+        sequenceLength = 2;
+    } else if (byte >= 0xE0 && byte <= 0xEF) {
+        sequenceLength = 3;
+        min = byte == 0xE0 ? 0xA0 : 0x80;
+        max = byte == 0xED ? 0x9F : 0xBF;
+    } else if (byte >= 0xF0 && byte <= 0xF4) {
+        sequenceLength = 4;
+        min = byte == 0xF0 ? 0x90 : 0x80;
+        max = byte == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        return 0;
+    }
+
+    if (length - offset < sequenceLength) {
+        return 0;
+    }
+
+    auto secondByte = static_cast<unsigned char>(characters[offset + 1]);
+
+    if (secondByte < min || secondByte > max) {
+        return 0;
+    }
+
+    for (std::size_t i = 2; i < sequenceLength; ++i) {
+        if ((static_cast<unsigned char>(characters[offset + i]) & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+
+    return sequenceLength;
+}
+
+
+Encoding
+Utf8::ClassifyBytes(const char *characters, std::size_t length)
+{
+    auto bytes = reinterpret_cast<const unsigned char *>(characters);
+    bool isAscii = true;
+    std::size_t i = 0;
+
+    while (i < length) {
+        if (i + 8 <= length) {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+
+            if ((word & kHighBits) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        unsigned char byte = bytes[i];
+
+        if (byte < 0x80) {
+            ++i;
+            continue;
+        }
+
+        isAscii = false;
+        std::size_t sequenceLength = GetSequenceLength(characters, length, i);
+
+        if (sequenceLength == 0) {
+            return Encoding::Binary;
+        }
+
+        i += sequenceLength;
+    }
+
+    return isAscii ? Encoding::Ascii : Encoding::Utf8;
+}
+
+
+template<class Vectors>
+Encoding
+Utf8::ClassifyVectors(const char *characters, std::size_t length)
+{
+    typedef typename Vectors::Vector Vector;
+    constexpr std::size_t kVectorSize = sizeof(Vector);
+    // Leading bytes in the last three positions whose sequences run past
+    // the vector come out nonzero once those are subtracted.
+    static const unsigned char maxima[32] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+    };
+    Vector maximum = Vectors::Load(reinterpret_cast<const char *>(maxima) + 32 - kVectorSize);
+    Vector errors = Vectors::Splat(0);
+    Vector previous = Vectors::Splat(0);
+    Vector incomplete = Vectors::Splat(0);
+    bool isAscii = true;
+
+    auto check = [&] (Vector vector) -> void {
+        if (Vectors::IsAscii(vector)) {
+            // Sequences cut short by ASCII are all the errors there may be.
+            errors = Vectors::Or(errors, incomplete);
+        } else {
+            isAscii = false;
+            errors = Vectors::Or(errors, CheckVector<Vectors>(vector, previous));
+            incomplete = Vectors::SubtractSaturated(vector, maximum);
+        }
+
+        previous = vector;
+    };
+
+    std::size_t i = 0;
+
+    for (; i + kVectorSize <= length; i += kVectorSize) {
+        check(Vectors::Load(characters + i));
+    }
+
+    // The rest is padded with at least one NUL, which also ends sequences
+    // cut short by the end of the string.
+    char rest[kVectorSize] = {};
+    std::memcpy(rest, characters + i, length - i);
+    check(Vectors::Load(rest));
+
+    if (!Vectors::IsZero(Vectors::Or(errors, incomplete))) {
+        return Encoding::Binary;
+    } else {
+        return isAscii ? Encoding::Ascii : Encoding::Utf8;
+    }
+}
+
+
+template<class Vectors>
+typename Vectors::Vector
+Utf8::CheckVector(typename Vectors::Vector vector, typename Vectors::Vector previous)
+{
+    typedef typename Vectors::Vector Vector;
+    // Each error, a bit set in all three tables for some pair of a byte and
+    // the one before it.
+    constexpr unsigned char kTooShort = 1 << 0;
+    constexpr unsigned char kTooLong = 1 << 1;
+    constexpr unsigned char kOverlong3 = 1 << 2;
+    constexpr unsigned char kTooLarge = 1 << 3;
+    constexpr unsigned char kSurrogate = 1 << 4;
+    constexpr unsigned char kOverlong2 = 1 << 5;
+    // Either 11110000 1000xxxx or 11110101+ 1000xxxx.
+    constexpr unsigned char kOverlong4OrTooLarge1000 = 1 << 6;
+    // Two continuation bytes in a row, an error unless they follow a
+    // leading byte of 1110xxxx or 11110xxx, which the lengths check.
+    constexpr unsigned char kTwoContinuations = 1 << 7;
+    constexpr unsigned char kCarry = kTooShort | kTooLong | kTwoContinuations;
+
+    // By the high nibble of the byte before.
+    static const unsigned char firstHighNibbles[16] = {
+        kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+        kTwoContinuations, kTwoContinuations, kTwoContinuations, kTwoContinuations,
+        kTooShort | kOverlong2,
+        kTooShort,
+        kTooShort | kOverlong3 | kSurrogate,
+        kTooShort | kTooLarge | kOverlong4OrTooLarge1000,
+    };
+    // By the low nibble of the byte before.
+    static const unsigned char firstLowNibbles[16] = {
+        kCarry | kOverlong3 | kOverlong2 | kOverlong4OrTooLarge1000,
+        kCarry | kOverlong2,
+        kCarry,
+        kCarry,
+        kCarry | kTooLarge,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000 | kSurrogate,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+        kCarry | kTooLarge | kOverlong4OrTooLarge1000,
+    };
+    // By the high nibble of the byte itself.
+    static const unsigned char secondHighNibbles[16] = {
+        kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+        kTooLong | kOverlong2 | kTwoContinuations | kOverlong3 | kOverlong4OrTooLarge1000,
+        kTooLong | kOverlong2 | kTwoContinuations | kOverlong3 | kTooLarge,
+        kTooLong | kOverlong2 | kTwoContinuations | kSurrogate | kTooLarge,
+        kTooLong | kOverlong2 | kTwoContinuations | kSurrogate | kTooLarge,
+        kTooShort, kTooShort, kTooShort, kTooShort,
+    };
+
+    Vector previous1 = Vectors::template Shift<1>(vector, previous);
+    Vector errors = Vectors::And(
+        Vectors::And(Vectors::Lookup(firstHighNibbles, Vectors::ShiftRight4(previous1)),
+                     Vectors::Lookup(firstLowNibbles,
+                                     Vectors::And(previous1, Vectors::Splat(0x0F)))),
+        Vectors::Lookup(secondHighNibbles, Vectors::ShiftRight4(vector)));
+    // Third and fourth bytes of sequences, whose high bits come out set.
+    Vector continuations = Vectors::Or(
+        Vectors::SubtractSaturated(Vectors::template Shift<2>(vector, previous),
+                                   Vectors::Splat(0xE0 - 0x80)),
+        Vectors::SubtractSaturated(Vectors::template Shift<3>(vector, previous),
+                                   Vectors::Splat(0xF0 - 0x80)));
+    // Those have to be continuation bytes following another one, and the
+    // only pairs of continuation bytes allowed.
+    return Vectors::Xor(Vectors::And(continuations, Vectors::Splat(0x80)), errors);
+}
+
+} // namespace Karina
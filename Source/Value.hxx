@@ -1,9 +1,38 @@
 #pragma once
 
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <new>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "ArenaScope.hxx"
+#include "CopyCounter.hxx"
+#include "CycleCollector.hxx"
+#include "GarbageCollector.hxx"
+#include "Heap.hxx"
+#include "MemoryQuota.hxx"
+#include "Pool.hxx"
+#include "ReleaseQueue.hxx"
+#include "Utf8.hxx"
+
+
+// Define KARINA_NAN_BOXING to pack every value into a single 64-bit word.
+// Integers are then limited to 47 bits, larger ones throw std::out_of_range.
+#if defined(KARINA_NAN_BOXING)
+#   if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#       error "NaN-boxing requires a little-endian target"
+#   endif
+#endif
 
 
 namespace Karina {
@@ -12,19 +41,43 @@ class String;
 class Array;
 class Dictionary;
 class Closure;
+class WeakReference;
+class ValueData;
+class ValueRef;
+template<std::size_t>
+class StaticString;
 
 
 class Value final
 {
 public:
+#if defined(KARINA_NAN_BOXING)
+    class IntegerReference;
+    class IntegerPointer;
+    class FloatingPointReference;
+    class FloatingPointPointer;
+#else
+    typedef unsigned long *IntegerPointer;
+    typedef double *FloatingPointPointer;
+#endif
+
+    inline static Value MakeString(const char *, std::size_t);
+    // Returns a copy of the interned string with these characters on the
+    // calling thread, e.g. for identifiers and dictionary keys, so that equal
+    // ones are one object.
+    inline static Value MakeInternedString(const char *, std::size_t);
+    // Both must be strings, short or not.
+    inline static Value Concatenate(const Value &, const Value &);
+    // Takes that many characters from that offset on of a string, short or
+    // not.
+    inline static Value Substring(const Value &, std::size_t, std::size_t);
     template<class... Args>
-    inline static Value MakeString(Args... args);
+    inline static Value MakeArray(Args &&... args);
     template<class... Args>
-    inline static Value MakeArray(Args... args);
+    inline static Value MakeDictionary(Args &&... args);
     template<class... Args>
-    inline static Value MakeDictionary(Args... args);
-    template<class... Args>
-    inline static Value MakeClosure(Args... args);
+    inline static Value MakeClosure(Args &&... args);
+    inline static Value MakeWeakReference(const Value &);
 
     inline explicit Value();
     inline explicit Value(bool);
@@ -35,30 +88,46 @@ public:
     inline Value(Value &&);
     inline ~Value();
 
-    template<class T>
-    inline void operator=(T &&);
+    inline void operator=(const Value &);
+    inline void operator=(Value &&);
+
+    // Calls the visitor with nullptr, bool *, IntegerPointer,
+    // FloatingPointPointer, a string's characters and length, Array *,
+    // Dictionary *, Closure * or WeakReference *.
+    template<class Visitor>
+    inline auto visit(Visitor &&) -> decltype(std::declval<Visitor &>()(nullptr));
 
     inline Value *tryDereference();
+    inline void share();
+    // Leaks the object held, for constants made at run time which live as
+    // long as the program. Must come before share().
+    inline void makeImmortal();
 
     inline bool isNull() const;
     inline bool isBoolean() const;
     inline bool isInteger() const;
     inline bool isFloatingPoint() const;
+    // Short or not.
     inline bool isString() const;
     inline bool isArray() const;
     inline bool isDictionary() const;
     inline bool isClosure() const;
+    inline bool isWeakReference() const;
 
     inline bool *getBoolean();
-    inline unsigned long *getInteger();
-    inline double *getFloatingPoint();
+    inline IntegerPointer getInteger();
+    inline FloatingPointPointer getFloatingPoint();
+    // Null for a short string, which is kept in the value itself.
     inline String *getString();
     inline Array *getArray();
     inline Dictionary *getDictionary();
     inline Closure *getClosure();
+    inline WeakReference *getWeakReference();
+    // Of any string, setting the length. Flattens a concatenation.
+    inline char *getStringCharacters(std::size_t *);
 
 private:
-    enum class Type
+    enum class Type : unsigned char
     {
         Null = 0,
         Boolean,
@@ -68,53 +137,484 @@ private:
         Array,
         Dictionary,
         Closure,
+        WeakReference,
         Reference,
+        ShortString,
+    };
+
+    // String, Array, Dictionary, Closure and WeakReference, which must stay
+    // contiguous, hold a ValueData.
+    inline bool hasValueData() const;
+    inline Type getType() const;
+    inline ValueData *getValueData() const;
+    // Points the value to a moved object of the same type.
+    inline void setValueData(ValueData *);
+
+#define VALUE_VISITOR(valueType)                     \
+    template<class Result, class Visitor>            \
+    inline static Result Visit##valueType(Value *, Visitor &);
+
+    VALUE_VISITOR(Null)
+    VALUE_VISITOR(Boolean)
+    VALUE_VISITOR(Integer)
+    VALUE_VISITOR(FloatingPoint)
+    VALUE_VISITOR(String)
+    VALUE_VISITOR(Array)
+    VALUE_VISITOR(Dictionary)
+    VALUE_VISITOR(Closure)
+    VALUE_VISITOR(WeakReference)
+
+#undef VALUE_VISITOR
+
+#if defined(KARINA_NAN_BOXING)
+    // Any bit pattern below kMinBoxedBits is a double. Above it, in a slice
+    // of the negative quiet NaN space that arithmetic never produces,
+    // bits 50..47 hold the type (plus one) and bits 46..0 the payload.
+    static constexpr std::uint64_t kMinBoxedBits = UINT64_C(0xFFF8800000000000);
+    static constexpr std::uint64_t kPayloadMask = (UINT64_C(1) << 47) - 1;
+    static constexpr std::uint64_t kCanonicalNaNBits = UINT64_C(0x7FF8000000000000);
+
+    // A short string keeps its characters in the low bytes of the payload
+    // and its length in bits 42..40.
+    static constexpr std::size_t kShortStringCapacity = 5;
+
+    union {
+        std::uint64_t bits_;
+        bool boolean_;
     };
 
+    inline static std::uint64_t Box(Type, std::uint64_t);
+    // Throws if the integer does not fit.
+    inline static std::uint64_t BoxInteger(unsigned long);
+    // NaNs come out canonical, lest they read back as boxed values.
+    inline static std::uint64_t BoxFloatingPoint(double);
+
+    inline std::uint64_t getPayload() const;
+#else
+    // A short string keeps its characters in shortString_ and runs on into
+    // shortStringTail_, filling up the padding after type_.
+    static constexpr std::size_t kShortStringCapacity = 14;
+
     Type type_;
+    unsigned char shortStringLength_;
+    char shortString_[6];
 
     union {
         Value *reference_;
         bool boolean_;
         unsigned long integer_;
         double floatingPoint_;
-        String *string_;
-        Array *array_;
-        Dictionary *dictionary_;
-        Closure *closure_;
+        ValueData *valueData_;
+        char shortStringTail_[8];
     };
+#endif
+
+    inline explicit Value(const char *, std::size_t) noexcept;
+
+    inline char *getShortString();
+    inline std::size_t getShortStringLength() const;
+    // Of any string, without flattening a concatenation.
+    inline std::size_t getStringLength() const;
 
     inline explicit Value(String *) noexcept;
     inline explicit Value(Array *) noexcept;
     inline explicit Value(Dictionary *) noexcept;
     inline explicit Value(Closure *) noexcept;
+    inline explicit Value(WeakReference *) noexcept;
+
+    template<std::size_t>
+    friend class StaticString;
+#if defined(KARINA_ARENA_SCOPES)
+    friend ArenaScope;
+#endif
+#if defined(KARINA_CYCLE_COLLECTOR)
+    friend CycleCollector;
+#endif
+    friend GarbageCollector;
+    friend Heap;
+    friend String;
+    friend WeakReference;
+};
+
+
+#if defined(KARINA_NAN_BOXING)
+static_assert(sizeof(Value) == 8, "NaN-boxed values must fit in one word");
+#else
+static_assert(sizeof(Value) == 16, "values must fit in two words");
+#endif
+
+
+#if defined(KARINA_NAN_BOXING)
+
+
+class Value::IntegerReference final
+{
+public:
+    inline explicit IntegerReference(std::uint64_t *);
+
+    inline operator unsigned long() const;
+    inline IntegerReference &operator=(unsigned long);
+    inline IntegerReference &operator=(const IntegerReference &);
+
+private:
+    std::uint64_t *bits_;
+};
+
+
+class Value::IntegerPointer final
+{
+public:
+    inline explicit IntegerPointer(std::uint64_t *);
+
+    inline IntegerReference operator*() const;
+
+private:
+    std::uint64_t *bits_;
+};
+
+
+class Value::FloatingPointReference final
+{
+public:
+    inline explicit FloatingPointReference(std::uint64_t *);
+
+    inline operator double() const;
+    inline FloatingPointReference &operator=(double);
+    inline FloatingPointReference &operator=(const FloatingPointReference &);
+
+private:
+    std::uint64_t *bits_;
+};
+
+
+class Value::FloatingPointPointer final
+{
+public:
+    inline explicit FloatingPointPointer(std::uint64_t *);
+
+    inline FloatingPointReference operator*() const;
+
+private:
+    std::uint64_t *bits_;
+};
+#endif
+
+
+// A borrowed view of a value, for passing arguments to native functions and
+// internal APIs. Reading through it never touches the copy count; it must not
+// outlive the value it refers to.
+class ValueRef final
+{
+public:
+    inline ValueRef(Value &);
+
+    inline Value toValue() const;
+
+    inline bool isNull() const;
+    inline bool isBoolean() const;
+    inline bool isInteger() const;
+    inline bool isFloatingPoint() const;
+    inline bool isString() const;
+    inline bool isArray() const;
+    inline bool isDictionary() const;
+    inline bool isClosure() const;
+    inline bool isWeakReference() const;
+
+    inline bool *getBoolean() const;
+    inline Value::IntegerPointer getInteger() const;
+    inline Value::FloatingPointPointer getFloatingPoint() const;
+    inline String *getString() const;
+    inline Array *getArray() const;
+    inline Dictionary *getDictionary() const;
+    inline Closure *getClosure() const;
+    inline WeakReference *getWeakReference() const;
+    inline char *getStringCharacters(std::size_t *) const;
+
+private:
+    Value *value_;
 };
 
 
+// ValueData has no vtable: the type tag next to the copy count tells
+// destroy() which destructor to run.
 class ValueData
 {
     ValueData(const ValueData &) = delete;
     void operator=(const ValueData &) = delete;
 
 public:
+    inline static void *operator new(std::size_t);
+    inline static void operator delete(void *, std::size_t);
+
     inline ValueData *copy();
     inline void destroy();
+    inline void share();
+    inline void makeImmortal();
+    inline std::size_t getSize() const;
 
-private:
-    int copyCount_;
+protected:
+    enum class Type : unsigned char
+    {
+        String = 0,
+        Array,
+        Dictionary,
+        Closure,
+        WeakReference,
+    };
+
+    inline explicit ValueData(Type);
+    inline constexpr explicit ValueData(Type, ImmortalTag);
+    ~ValueData() = default;
 
-    inline explicit ValueData();
-    inline virtual ~ValueData() = default;
+private:
+    // An immortal object is never released and its copy counter is never
+    // touched, so that it may be shared freely or live in read-only memory.
+    static constexpr unsigned short kImmortalFlag = 1;
+    // The object is a candidate of the cycle collector.
+    static constexpr unsigned short kBufferedFlag = 2;
+    // The object has been reached by the garbage collector.
+    static constexpr unsigned short kMarkedFlag = 4;
+    // The young object has been promoted, next_ points to the old one.
+    static constexpr unsigned short kForwardedFlag = 8;
+    // The old array is in the remembered set.
+    static constexpr unsigned short kRememberedFlag = 16;
+    // The object belongs to an arena, which releases it along with the rest.
+    static constexpr unsigned short kRegionalFlag = 32;
+    // The copy counter of such objects is never touched.
+    static constexpr unsigned short kUncountedFlags = kImmortalFlag | kRegionalFlag;
+    // The object has a weak reference, to be cleared once it is released.
+    static constexpr unsigned short kWeaklyReferencedFlag = 64;
+    // The string is in the intern table, to be removed once it is released.
+    static constexpr unsigned short kInternedFlag = 128;
+    // The string is a concatenation, see String::Concatenate().
+    static constexpr unsigned short kConcatenationFlag = 256;
+    // The string is a slice, see String::Substring().
+    static constexpr unsigned short kSliceFlag = 512;
+    // The string has been classified, see String::isUtf8().
+    static constexpr unsigned short kClassifiedFlag = 1024;
+    static constexpr unsigned short kAsciiFlag = 2048;
+    static constexpr unsigned short kUtf8Flag = 4096;
+    // The string has a codepoint index, to be removed once it is released.
+    static constexpr unsigned short kIndexedFlag = 8192;
+    // The object has been shared, so it is kept out of the side tables,
+    // which are per thread.
+    static constexpr unsigned short kSharedFlag = 16384;
+
+    // Must stay the first member, see BiasedCopyCounter::Release().
+    CopyCounter copyCounter_;
+    Type type_;
+    unsigned short flags_;
+#if defined(KARINA_MARK_SWEEP)
+    // The next old object allocated before this one on the same thread.
+    ValueData *next_;
+#endif
+
+    inline static void *Allocate(std::size_t);
+#if defined(KARINA_DEFERRED_RELEASE)
+    // Constructs the per-thread state that releasing an object touches.
+    inline static void MakeThreadLocals();
+#endif
+
+    inline void release();
+
+    friend Array;
+#if defined(KARINA_ARENA_SCOPES)
+    friend ArenaScope;
+#endif
+    friend BiasedCopyCounter;
+#if defined(KARINA_CYCLE_COLLECTOR)
+    friend CycleCollector;
+#endif
+    friend GarbageCollector;
+    friend Heap;
+#if defined(KARINA_DEFERRED_RELEASE)
+    friend ReleaseQueue;
+#endif
+    friend String;
+    friend WeakReference;
 };
 
 
+// Strings and arrays are laid out in one allocation, with the characters
+// or elements trailing the object and sized exactly at creation.
+//
+// A concatenation holds copies of its two halves instead, so that building
+// a string piecewise takes constant time per piece rather than copying
+// everything so far. It gets flattened the first time its characters are
+// needed: the characters are copied into a new string, which replaces the
+// left half, and the right half is let go of.
+//
+// A slice holds a copy of a flat string and an offset into it instead,
+// so that taking substrings copies nothing. Slices that pin a much longer
+// string get characters of their own: with KARINA_MARK_SWEEP, as marking
+// finds the longer string held by such slices only, otherwise as they get
+// shared.
+//
+// Codepoints are counted and looked up in constant time for ASCII strings.
+// Longer UTF-8 strings get a sparse index of codepoints to bytes the first
+// time it is needed, unless they have been shared, as each thread has its
+// own indices. Shorter or shared ones are scanned.
 class String final : public ValueData
 {
     String(const String &) = delete;
     void operator=(const String &) = delete;
 
 public:
-    inline ~String() override;
+    inline static String *New(const char *, std::size_t);
+    inline static void Delete(String *);
+    // Seeded per process.
+    inline static std::size_t Hash(const char *, std::size_t);
+
+    // Flattens a concatenation.
+    inline char *getCharacters();
+    inline std::size_t getLength() const;
+    inline std::size_t getSize() const;
+    inline bool isConcatenation() const;
+    inline bool isSlice() const;
+    // Computed once, unless the string is static.
+    inline std::size_t getHash();
+    inline bool isInterned() const;
+    // Two interned strings are equal only if they are the same. Sharing a
+    // string uninterns it, so both are in the thread's own table.
+    inline bool equals(String *);
+    // Worked out along with isAscii() once, as needed, and at compile time
+    // for static strings. Flattens a concatenation.
+    inline bool isUtf8();
+    inline bool isAscii();
+    // Of a UTF-8 string.
+    inline std::size_t getCodepointCount();
+    // Returns the byte offset of the codepoint at the index, which may be
+    // the count.
+    inline std::size_t getCodepointOffset(std::size_t);
+
+private:
+    // Shorter concatenations are copied.
+    static constexpr std::size_t kMinConcatenationLength = 64;
+    // Deeper concatenations are rebalanced.
+    static constexpr std::size_t kMaxConcatenationDepth = 48;
+    // Rebalancing merges runs of pieces up to that long into one string.
+    static constexpr std::size_t kMaxMergedLength = 1024;
+    // Shorter substrings are copied, a slice would take about as much room.
+    static constexpr std::size_t kMinSliceLength = 32;
+    // Slices of a string get compacted if they add up to no more than that
+    // fraction of it.
+    static constexpr std::size_t kCompactionRatio = 8;
+    // Shorter UTF-8 strings get no codepoint index.
+    static constexpr std::size_t kMinIndexedLength = 256;
+    // The index has the offset of every that many codepoints.
+    static constexpr std::size_t kCodepointIndexStride = 64;
+
+    // Trails a concatenation in place of the characters.
+    struct Concatenation
+    {
+        // Once flattened, the left half is the flat string and the right
+        // one null.
+        Value left;
+        Value right;
+        // Of the tree of concatenations, counting this one.
+        std::size_t depth;
+    };
+
+    // Trails a slice in place of the characters.
+    struct Slice
+    {
+        // Always flat.
+        Value parent;
+        std::size_t offset;
+    };
+
+    struct CodepointIndex
+    {
+        std::size_t codepointCount;
+        // Of codepoints 0, kCodepointIndexStride, and so on up to the count.
+        std::vector<std::size_t> offsets;
+    };
+
+    std::size_t length_;
+    // Zero until computed, strings that hash to zero get hashed every time.
+    std::size_t hash_;
+
+    // Interned strings by hash, held without being counted. Each thread has
+    // its own, strings get uninterned as they are shared.
+    inline static std::unordered_multimap<std::size_t, String *> &GetTable();
+    // Sets the first to the low half of their product, the second to the
+    // high one.
+    inline static void Multiply(std::uint64_t *, std::uint64_t *);
+    // Returns a new copy of the interned string.
+    inline static String *Intern(const char *, std::size_t);
+    // Called as the interned string gets released or shared.
+    inline static void Unintern(String *);
+    // Codepoint indices by string, for the thread's strings only.
+    inline static std::unordered_map<String *, CodepointIndex> &GetCodepointIndices();
+    // Called as the indexed string gets released or shared.
+    inline static void Unindex(String *);
+    // Returns a new concatenation of the strings, which must be long enough
+    // together.
+    inline static String *Concatenate(String *, String *);
+    inline static String *Join(Value &&, Value &&);
+    // Joins [leaves, leaves + count) into a balanced tree.
+    inline static Value Balance(Value *, std::size_t);
+    // Returns a new slice of the string, which must be long enough.
+    inline static String *Substring(String *, std::size_t, std::size_t);
+
+    inline explicit String(std::size_t);
+    inline explicit String(std::size_t, Value &&, Value &&, std::size_t);
+    inline explicit String(std::size_t, Value &&, std::size_t);
+    // Immortal, and classified already.
+    inline constexpr explicit String(std::size_t, Encoding, ImmortalTag);
+    ~String() = default;
+
+    inline Concatenation *getConcatenation();
+    // A flattened concatenation stands for its flat string.
+    inline String *resolve();
+    inline std::size_t getDepth();
+    inline void flatten();
+    inline Slice *getSlice();
+    // Gives the slice characters of its own, letting go of its parent.
+    inline void compact();
+    // Sets the encoding flags, for good unless the string is immortal, in
+    // which case they were set already.
+    inline unsigned short classify();
+    // Null for shorter, shared and immortal strings.
+    inline CodepointIndex *getCodepointIndex();
+
+#if defined(KARINA_ARENA_SCOPES)
+    friend ArenaScope;
+#endif
+    friend GarbageCollector;
+    friend Heap;
+    template<std::size_t>
+    friend class StaticString;
+    friend Value;
+    friend ValueData;
+};
+
+
+// A string constant built at compile time, which never gets copied or
+// released and may thus go to read-only memory:
+//
+//     static constexpr StaticString<6> kReturn("return");
+//
+// Strings short enough to be inlined into a value are inlined anyway.
+template<std::size_t N>
+class StaticString final
+{
+    StaticString(const StaticString &) = delete;
+    void operator=(const StaticString &) = delete;
+
+public:
+    inline constexpr explicit StaticString(const char (&)[N + 1]);
+
+    inline Value get() const;
+
+private:
+    String string_;
+    // Trails string_ as String::getCharacters() expects, since sizeof(String)
+    // is a multiple of its alignment.
+    char characters_[N + 1];
+
+    template<std::size_t... I>
+    inline constexpr explicit StaticString(const char (&)[N + 1], std::index_sequence<I...>);
 };
 
 
@@ -124,7 +624,33 @@ class Array final : public ValueData
     void operator=(const Array &) = delete;
 
 public:
-    inline ~Array() override;
+    // With no elements, returns the immortal empty array.
+    inline static Array *New();
+    template<class... Args>
+    inline static Array *New(Args &&...);
+    // Makes an array of that many null elements.
+    inline static Array *NewOfLength(std::size_t);
+    inline static void Delete(Array *);
+
+    // Stores must go through setElement() with KARINA_NURSERY.
+    inline Value *getElements();
+    inline void setElement(std::size_t, const Value &);
+    inline std::size_t getLength() const;
+    inline std::size_t getSize() const;
+
+private:
+    std::size_t length_;
+
+    // Frees the array, its elements being destroyed already.
+    inline static void Deallocate(Array *);
+
+    inline explicit Array(std::size_t);
+    inline constexpr explicit Array(std::size_t, ImmortalTag);
+    ~Array() = default;
+
+#if defined(KARINA_DEFERRED_RELEASE)
+    friend ReleaseQueue;
+#endif
 };
 
 
@@ -134,7 +660,8 @@ class Dictionary final : public ValueData
     void operator=(const Dictionary &) = delete;
 
 public:
-    inline ~Dictionary() override;
+    inline explicit Dictionary();
+    inline ~Dictionary();
 };
 
 
@@ -144,295 +671,3173 @@ class Closure final : public ValueData
     void operator=(const Closure &) = delete;
 
 public:
-    inline ~Closure() override;
+    inline explicit Closure();
+    inline ~Closure();
 };
 
 
-#define VALUE_MAKER(valueType)                                 \
-    template<class... Args>                                    \
-    Value                                                      \
-    Value::Make##valueType(Args... args)                       \
-    {                                                          \
-        return Value(new String(std::forward<Args>(args)...)); \
+// Refers to the object held by a value without keeping it alive, and gets
+// cleared once the object is released. A mortal object has at most one
+// weak reference, found through a side table, so that weak references may
+// key weak tables. Values holding no object, and immortal objects, are
+// simply held on to. The side table is per thread: sharing either a weak
+// reference or its object clears the former, and weak references to shared
+// objects are made cleared.
+class WeakReference final : public ValueData
+{
+    WeakReference(const WeakReference &) = delete;
+    void operator=(const WeakReference &) = delete;
+
+public:
+    // Returns the value, or null once its object is gone.
+    inline Value get() const;
+    inline bool isCleared() const;
+
+private:
+    // Copied without being counted.
+    Value value_;
+
+    inline static std::unordered_map<ValueData *, WeakReference *> &GetTable();
+    // Returns a new copy of the weak reference to the object held.
+    inline static WeakReference *Make(const Value &);
+    // Called as the object gets released or shared.
+    inline static void Clear(ValueData *);
+
+    inline explicit WeakReference(const Value &);
+    inline ~WeakReference();
+
+    // Clears the weak reference as it gets shared, unless it holds on to
+    // its value.
+    inline void detach();
+
+#if defined(KARINA_ARENA_SCOPES)
+    friend ArenaScope;
+#endif
+    friend GarbageCollector;
+    friend Value;
+    friend ValueData;
+};
+
+
+Value
+Value::MakeInternedString(const char *characters, std::size_t length)
+{
+    if (length <= kShortStringCapacity) {
+        return Value(characters, length);
+    } else {
+        Value value(String::Intern(characters, length));
+#if defined(KARINA_INCREMENTAL_MARKING)
+        // The string may be what marking has yet to reach.
+        GarbageCollector::MarkingBarrier(value);
+#endif
+        return value;
     }
+}
 
-VALUE_MAKER(String)
-VALUE_MAKER(Array)
-VALUE_MAKER(Dictionary)
-VALUE_MAKER(Closure)
 
-#undef VALUE_MAKER
+Value
+Value::Concatenate(const Value &left, const Value &right)
+{
+    assert(left.isString());
+    assert(right.isString());
+    // The getters leave the values alone.
+    Value &mutableLeft = const_cast<Value &>(left);
+    Value &mutableRight = const_cast<Value &>(right);
+    std::size_t leftLength = left.getStringLength();
+    std::size_t rightLength = right.getStringLength();
+    std::size_t length = leftLength + rightLength;
+
+    if (leftLength == 0) {
+        return right;
+    } else if (rightLength == 0) {
+        return left;
+    } else if (length < String::kMinConcatenationLength) {
+        // Neither is a concatenation then, and copying costs no more than
+        // linking.
+        char characters[String::kMinConcatenationLength];
+        std::memcpy(characters, mutableLeft.getStringCharacters(&leftLength), leftLength);
+        std::memcpy(characters + leftLength, mutableRight.getStringCharacters(&rightLength),
+                    rightLength);
+        return MakeString(characters, length);
+    } else {
+        Value leftString = left.getType() == Type::String
+                           ? left
+                           : Value(String::New(mutableLeft.getShortString(), leftLength));
+        Value rightString = right.getType() == Type::String
+                            ? right
+                            : Value(String::New(mutableRight.getShortString(), rightLength));
+        return Value(String::Concatenate(leftString.getString(), rightString.getString()));
+    }
+}
 
 
-Value::Value()
-  : type_(Type::Null)
+Value
+Value::Substring(const Value &string, std::size_t offset, std::size_t length)
 {
+    assert(string.isString());
+    // The getters leave the value alone.
+    Value &mutableString = const_cast<Value &>(string);
+    assert(offset + length <= string.getStringLength());
+
+    if (length == string.getStringLength()) {
+        return string;
+    } else if (length < String::kMinSliceLength) {
+        std::size_t stringLength;
+        return MakeString(mutableString.getStringCharacters(&stringLength) + offset, length);
+    } else {
+        // Short strings are shorter than any slice.
+        return Value(String::Substring(mutableString.getString(), offset, length));
+    }
 }
 
 
-#define VALUE_CONSTRUCTOR1(valueType, simpleValueDataT, simpleValueData) \
-    Value::Value(simpleValueDataT x)                                     \
-      : type_(Type::valueType),                                          \
-        simpleValueData(x)                                               \
-    {                                                                    \
+Value
+Value::MakeString(const char *characters, std::size_t length)
+{
+    if (length <= kShortStringCapacity) {
+        return Value(characters, length);
+    } else {
+        return Value(String::New(characters, length));
     }
+}
 
-VALUE_CONSTRUCTOR1(Boolean, bool, boolean_)
-VALUE_CONSTRUCTOR1(Integer, unsigned long, integer_)
-VALUE_CONSTRUCTOR1(FloatingPoint, double, floatingPoint_)
-VALUE_CONSTRUCTOR1(Reference, Value *, reference_)
 
-#undef VALUE_CONSTRUCTOR1
+template<class... Args>
+Value
+Value::MakeArray(Args &&... args)
+{
+    return Value(Array::New(std::forward<Args>(args)...));
+}
 
 
-#define VALUE_CONSTRUCTOR2(valueType, valueDataT, valueData) \
-    Value::Value(valueDataT x) noexcept                      \
-      : type_(Type::valueType),                              \
-        valueData(x)                                         \
-    {                                                        \
+#define VALUE_MAKER(valueType)                                    \
+    template<class... Args>                                       \
+    Value                                                         \
+    Value::Make##valueType(Args &&... args)                       \
+    {                                                             \
+        return Value(new valueType(std::forward<Args>(args)...)); \
     }
 
-VALUE_CONSTRUCTOR2(String, String *, string_)
-VALUE_CONSTRUCTOR2(Array, Array *, array_)
-VALUE_CONSTRUCTOR2(Dictionary, Dictionary *, dictionary_)
-VALUE_CONSTRUCTOR2(Closure, Closure *, closure_)
+VALUE_MAKER(Dictionary)
+VALUE_MAKER(Closure)
 
-#undef VALUE_CONSTRUCTOR2
+#undef VALUE_MAKER
 
 
-Value::Value(const Value &other)
+Value
+Value::MakeWeakReference(const Value &value)
 {
-    switch (other.type_) {
-    case Type::Null:
-        type_ = Type::Null;
-        break;
+    return Value(WeakReference::Make(value));
+}
 
-    case Type::Boolean:
-        type_ = Type::Boolean;
-        boolean_ = other.boolean_;
-        break;
 
-    case Type::Integer:
-        type_ = Type::Integer;
-        integer_ = other.integer_;
-        break;
+#if defined(KARINA_NAN_BOXING)
+std::uint64_t
+Value::Box(Type type, std::uint64_t payload)
+{
+    assert((payload & ~kPayloadMask) == 0);
+    return kMinBoxedBits + ((static_cast<std::uint64_t>(type) << 47) | payload);
+}
 
-    case Type::FloatingPoint:
-        type_ = Type::FloatingPoint;
-        floatingPoint_ = other.floatingPoint_;
-        break;
 
-    case Type::String:
-        type_ = Type::String;
-        string_ = static_cast<String *>(other.string_->copy());
-        break;
+std::uint64_t
+Value::BoxInteger(unsigned long x)
+{
+    if (x > kPayloadMask) {
+        throw std::out_of_range("integer does not fit in 47 bits");
+    }
 
-    case Type::Array:
-        type_ = Type::Array;
-        array_ = static_cast<Array *>(other.array_->copy());
-        break;
+    return Box(Type::Integer, x);
+}
 
-    case Type::Dictionary:
-        type_ = Type::Dictionary;
-        dictionary_ = static_cast<Dictionary *>(other.dictionary_->copy());
-        break;
 
-    case Type::Closure:
-        type_ = Type::Closure;
-        closure_ = static_cast<Closure *>(other.closure_->copy());
-        break;
+std::uint64_t
+Value::BoxFloatingPoint(double x)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &x, sizeof bits);
+    return bits < kMinBoxedBits ? bits : kCanonicalNaNBits;
+}
+
 
-    case Type::Reference:
-        assert(false);
+Value::Type
+Value::getType() const
+{
+    if (bits_ < kMinBoxedBits) {
+        return Type::FloatingPoint;
+    } else {
+        return static_cast<Type>(((bits_ - kMinBoxedBits) >> 47) & 0xF);
     }
 }
 
 
-Value::Value(Value &&other)
+std::uint64_t
+Value::getPayload() const
 {
-    switch (other.type_) {
-    case Type::Null:
-        type_ = Type::Null;
-        break;
+    return bits_ & kPayloadMask;
+}
 
-    case Type::Boolean:
-        type_ = Type::Boolean;
-        boolean_ = other.boolean_;
-        break;
 
-    case Type::Integer:
-        type_ = Type::Integer;
-        integer_ = other.integer_;
-        break;
+ValueData *
+Value::getValueData() const
+{
+    return reinterpret_cast<ValueData *>(getPayload());
+}
 
-    case Type::FloatingPoint:
-        type_ = Type::FloatingPoint;
-        floatingPoint_ = other.floatingPoint_;
-        break;
 
-    case Type::String:
-        type_ = Type::String;
-        string_ = other.string_;
-        other.type_ = Type::Null;
-        break;
+void
+Value::setValueData(ValueData *valueData)
+{
+    assert(hasValueData());
+    bits_ = Box(getType(), reinterpret_cast<std::uintptr_t>(valueData));
+}
 
-    case Type::Array:
-        type_ = Type::Array;
-        array_ = other.array_;
-        other.type_ = Type::Null;
-        break;
 
-    case Type::Dictionary:
-        type_ = Type::Dictionary;
-        dictionary_ = other.dictionary_;
-        other.type_ = Type::Null;
-        break;
+Value::Value()
+  : bits_(Box(Type::Null, 0))
+{
+}
 
-    case Type::Closure:
-        type_ = Type::Closure;
-        closure_ = other.closure_;
-        other.type_ = Type::Null;
-        break;
 
-    case Type::Reference:
-        assert(false);
-    }
+Value::Value(bool x)
+  : bits_(Box(Type::Boolean, x))
+{
 }
 
 
-Value::~Value()
+Value::Value(unsigned long x)
+  : bits_(BoxInteger(x))
 {
-    switch (type_) {
-    case Type::Null:
-    case Type::Boolean:
-    case Type::Integer:
-    case Type::FloatingPoint:
-    case Type::Reference:
-        break;
+}
 
-    case Type::String:
-        string_->destroy();
-        break;
 
-    case Type::Array:
-        array_->destroy();
-        break;
+Value::Value(double x)
+  : bits_(BoxFloatingPoint(x))
+{
+}
 
-    case Type::Dictionary:
-        dictionary_->destroy();
-        break;
 
-    case Type::Closure:
-        closure_->destroy();
-        break;
-    }
+Value::Value(Value *x)
+  : bits_(Box(Type::Reference, reinterpret_cast<std::uintptr_t>(x)))
+{
 }
 
 
-template<class T>
-void
-Value::operator=(T &&other)
+Value::Value(const char *characters, std::size_t length) noexcept
+  : bits_(Box(Type::ShortString, static_cast<std::uint64_t>(length) << 40))
 {
-    assert(type_ != Type::Reference);
-    assert(other.type_ != Type::Reference);
+    assert(length <= kShortStringCapacity);
+    std::memcpy(&bits_, characters, length);
+}
 
-    if (this == &other) {
-        return;
-    } else {
-        this->~Value();
-        new (this) Value(std::forward(other));
-        return;
+
+#define VALUE_CONSTRUCTOR(valueType, valueDataT)                                 \
+    Value::Value(valueDataT x) noexcept                                          \
+      : bits_(Box(Type::valueType,                                               \
+                  reinterpret_cast<std::uintptr_t>(static_cast<ValueData *>(x)))) \
+    {                                                                            \
     }
-}
+
+VALUE_CONSTRUCTOR(String, String *)
+VALUE_CONSTRUCTOR(Array, Array *)
+VALUE_CONSTRUCTOR(Dictionary, Dictionary *)
+VALUE_CONSTRUCTOR(Closure, Closure *)
+VALUE_CONSTRUCTOR(WeakReference, WeakReference *)
+
+#undef VALUE_CONSTRUCTOR
 
 
 Value *
 Value::tryDereference()
 {
-    if (type_ == Type::Reference) {
-        assert(reference_->type_ != Type::Reference);
-        return reference_;
+    if (getType() == Type::Reference) {
+        Value *reference = reinterpret_cast<Value *>(getPayload());
+        assert(reference->getType() != Type::Reference);
+        return reference;
     } else {
         return this;
     }
 }
 
 
-#define VALUE_TYPE_TESTER(valueType)      \
-    bool                                  \
-    Value::is##valueType() const          \
-    {                                     \
-        assert(type_ != Type::Reference); \
-        return type_ == Type::valueType;  \
-    }
+bool *
+Value::getBoolean()
+{
+    assert(getType() == Type::Boolean);
+    return &boolean_;
+}
 
-VALUE_TYPE_TESTER(Null)
-VALUE_TYPE_TESTER(Boolean)
-VALUE_TYPE_TESTER(Integer)
-VALUE_TYPE_TESTER(FloatingPoint)
-VALUE_TYPE_TESTER(String)
-VALUE_TYPE_TESTER(Array)
-VALUE_TYPE_TESTER(Dictionary)
-VALUE_TYPE_TESTER(Closure)
 
-#undef VALUE_TYPE_TESTER
+Value::IntegerPointer
+Value::getInteger()
+{
+    assert(getType() == Type::Integer);
+    return IntegerPointer(&bits_);
+}
 
 
-#define VALUE_DATA_GETTER1(valueType, simpleValueDataT, simpleValueData) \
-    simpleValueDataT *                                                   \
-    Value::get##valueType()                                              \
-    {                                                                    \
-        assert(type_ == Type::valueType);                                \
-        return &simpleValueData;                                         \
-    }
+Value::FloatingPointPointer
+Value::getFloatingPoint()
+{
+    assert(getType() == Type::FloatingPoint);
+    return FloatingPointPointer(&bits_);
+}
 
-VALUE_DATA_GETTER1(Boolean, bool, boolean_)
-VALUE_DATA_GETTER1(Integer, unsigned long, integer_)
-VALUE_DATA_GETTER1(FloatingPoint, double, floatingPoint_)
 
-#undef VALUE_DATA_GETTER1
+char *
+Value::getShortString()
+{
+    assert(getType() == Type::ShortString);
+    return reinterpret_cast<char *>(&bits_);
+}
 
 
-#define VALUE_DATA_GETTER2(valueType, valueDataT, valueData) \
-    valueDataT                                               \
-    Value::get##valueType()                                  \
-    {                                                        \
-        assert(type_ == Type::valueType);                    \
-        return valueData;                                    \
-    }
+std::size_t
+Value::getShortStringLength() const
+{
+    assert(getType() == Type::ShortString);
+    return getPayload() >> 40;
+}
 
-VALUE_DATA_GETTER2(String, String *, string_)
-VALUE_DATA_GETTER2(Array, Array *, array_)
-VALUE_DATA_GETTER2(Dictionary, Dictionary *, dictionary_)
-VALUE_DATA_GETTER2(Closure, Closure *, closure_)
 
-#undef VALUE_DATA_GETTER2
+Value::IntegerReference::IntegerReference(std::uint64_t *bits)
+  : bits_(bits)
+{
+}
 
 
-ValueData::ValueData()
-  : copyCount_(0)
+Value::IntegerReference::operator unsigned long() const
 {
+    return *bits_ & kPayloadMask;
 }
 
 
-ValueData *
-ValueData::copy()
+Value::IntegerReference &
+Value::IntegerReference::operator=(unsigned long x)
 {
-    ++copyCount_;
-    return this;
+    *bits_ = BoxInteger(x);
+    return *this;
+}
+
+
+Value::IntegerReference &
+Value::IntegerReference::operator=(const IntegerReference &other)
+{
+    return *this = static_cast<unsigned long>(other);
+}
+
+
+Value::IntegerPointer::IntegerPointer(std::uint64_t *bits)
+  : bits_(bits)
+{
+}
+
+
+Value::IntegerReference
+Value::IntegerPointer::operator*() const
+{
+    return IntegerReference(bits_);
+}
+
+
+Value::FloatingPointReference::FloatingPointReference(std::uint64_t *bits)
+  : bits_(bits)
+{
+}
+
+
+Value::FloatingPointReference::operator double() const
+{
+    double x;
+    std::memcpy(&x, bits_, sizeof x);
+    return x;
+}
+
+
+Value::FloatingPointReference &
+Value::FloatingPointReference::operator=(double x)
+{
+    *bits_ = BoxFloatingPoint(x);
+    return *this;
+}
+
+
+Value::FloatingPointReference &
+Value::FloatingPointReference::operator=(const FloatingPointReference &other)
+{
+    return *this = static_cast<double>(other);
+}
+
+
+Value::FloatingPointPointer::FloatingPointPointer(std::uint64_t *bits)
+  : bits_(bits)
+{
+}
+
+
+Value::FloatingPointReference
+Value::FloatingPointPointer::operator*() const
+{
+    return FloatingPointReference(bits_);
+}
+#else // !defined(KARINA_NAN_BOXING)
+Value::Value()
+  : type_(Type::Null)
+{
+}
+
+
+#define VALUE_CONSTRUCTOR1(valueType, simpleValueDataT, simpleValueData) \
+    Value::Value(simpleValueDataT x)                                     \
+      : type_(Type::valueType),                                          \
+        simpleValueData(x)                                               \
+    {                                                                    \
+    }
+
+VALUE_CONSTRUCTOR1(Boolean, bool, boolean_)
+VALUE_CONSTRUCTOR1(Integer, unsigned long, integer_)
+VALUE_CONSTRUCTOR1(FloatingPoint, double, floatingPoint_)
+VALUE_CONSTRUCTOR1(Reference, Value *, reference_)
+
+#undef VALUE_CONSTRUCTOR1
+
+
+#define VALUE_CONSTRUCTOR2(valueType, valueDataT) \
+    Value::Value(valueDataT x) noexcept           \
+      : type_(Type::valueType),                   \
+        valueData_(x)                             \
+    {                                             \
+    }
+
+VALUE_CONSTRUCTOR2(String, String *)
+VALUE_CONSTRUCTOR2(Array, Array *)
+VALUE_CONSTRUCTOR2(Dictionary, Dictionary *)
+VALUE_CONSTRUCTOR2(Closure, Closure *)
+VALUE_CONSTRUCTOR2(WeakReference, WeakReference *)
+
+#undef VALUE_CONSTRUCTOR2
+
+
+Value::Value(const char *characters, std::size_t length) noexcept
+  : type_(Type::ShortString),
+    shortStringLength_(length)
+{
+    assert(length <= kShortStringCapacity);
+    std::memcpy(getShortString(), characters, length);
+}
+
+
+Value::Type
+Value::getType() const
+{
+    return type_;
+}
+
+
+ValueData *
+Value::getValueData() const
+{
+    return valueData_;
 }
 
 
 void
-ValueData::destroy()
+Value::setValueData(ValueData *valueData)
 {
-    if (copyCount_ == 0) {
-        delete this;
-        return;
+    assert(hasValueData());
+    valueData_ = valueData;
+}
+
+
+Value *
+Value::tryDereference()
+{
+    if (type_ == Type::Reference) {
+        assert(reference_->type_ != Type::Reference);
+        return reference_;
+    } else {
+        return this;
+    }
+}
+
+
+#define VALUE_DATA_GETTER1(valueType, simpleValueDataT, simpleValueData) \
+    simpleValueDataT *                                                   \
+    Value::get##valueType()                                              \
+    {                                                                    \
+        assert(type_ == Type::valueType);                                \
+        return &simpleValueData;                                         \
+    }
+
+VALUE_DATA_GETTER1(Boolean, bool, boolean_)
+VALUE_DATA_GETTER1(Integer, unsigned long, integer_)
+VALUE_DATA_GETTER1(FloatingPoint, double, floatingPoint_)
+
+#undef VALUE_DATA_GETTER1
+
+
+char *
+Value::getShortString()
+{
+    static_assert(offsetof(Value, shortStringTail_)
+                  == offsetof(Value, shortString_) + sizeof shortString_,
+                  "short string storage must be contiguous");
+    assert(type_ == Type::ShortString);
+    return reinterpret_cast<char *>(this) + offsetof(Value, shortString_);
+}
+
+
+std::size_t
+Value::getShortStringLength() const
+{
+    assert(type_ == Type::ShortString);
+    return shortStringLength_;
+}
+#endif // defined(KARINA_NAN_BOXING)
+
+
+#if defined(KARINA_MARK_SWEEP)
+// Objects are reclaimed by the garbage collector alone, so copies are plain.
+Value::Value(const Value &other)
+{
+    assert(other.getType() != Type::Reference);
+    std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+}
+
+
+Value::Value(Value &&other)
+{
+    assert(other.getType() != Type::Reference);
+    std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+}
+
+
+Value::~Value()
+{
+}
+
+
+void
+Value::operator=(const Value &other)
+{
+    assert(getType() != Type::Reference);
+    assert(other.getType() != Type::Reference);
+#   if defined(KARINA_INCREMENTAL_MARKING)
+    GarbageCollector::MarkingBarrier(other);
+#   endif
+    std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+}
+
+
+void
+Value::operator=(Value &&other)
+{
+    assert(getType() != Type::Reference);
+    assert(other.getType() != Type::Reference);
+#   if defined(KARINA_INCREMENTAL_MARKING)
+    GarbageCollector::MarkingBarrier(other);
+#   endif
+    std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+}
+#else // !defined(KARINA_MARK_SWEEP)
+Value::Value(const Value &other)
+{
+    assert(other.getType() != Type::Reference);
+    std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+
+    if (hasValueData()) {
+        getValueData()->copy();
+    }
+}
+
+
+Value::Value(Value &&other)
+{
+    assert(other.getType() != Type::Reference);
+    std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+
+    if (hasValueData()) {
+        new (&other) Value();
+    }
+}
+
+
+Value::~Value()
+{
+    if (hasValueData()) {
+        getValueData()->destroy();
+    }
+}
+
+
+void
+Value::operator=(const Value &other)
+{
+    assert(getType() != Type::Reference);
+    assert(other.getType() != Type::Reference);
+
+    if (!hasValueData()) {
+        std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+
+        if (hasValueData()) {
+            getValueData()->copy();
+        }
     } else {
-        --copyCount_;
+        // Release the old data last, it may be what holds `other`.
+        ValueData *valueData = getValueData();
+        std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+
+        if (hasValueData()) {
+            getValueData()->copy();
+        }
+
+        valueData->destroy();
+    }
+}
+
+
+void
+Value::operator=(Value &&other)
+{
+    assert(getType() != Type::Reference);
+    assert(other.getType() != Type::Reference);
+
+    if (this == &other) {
         return;
     }
+
+    if (!hasValueData()) {
+        std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+
+        if (hasValueData()) {
+            new (&other) Value();
+        }
+    } else {
+        ValueData *valueData = getValueData();
+        std::memcpy(static_cast<void *>(this), &other, sizeof *this);
+
+        if (hasValueData()) {
+            new (&other) Value();
+        }
+
+        valueData->destroy();
+    }
+}
+#endif // defined(KARINA_MARK_SWEEP)
+
+
+template<class Visitor>
+auto
+Value::visit(Visitor &&visitor) -> decltype(std::declval<Visitor &>()(nullptr))
+{
+    typedef decltype(std::declval<Visitor &>()(nullptr)) Result;
+    typedef Result (*Visit)(Value *, Visitor &);
+
+    // Indexed by Type. References are dereferenced up front, so their slot
+    // is never taken.
+    static constexpr Visit visits[] = {
+        &VisitNull<Result, Visitor>,
+        &VisitBoolean<Result, Visitor>,
+        &VisitInteger<Result, Visitor>,
+        &VisitFloatingPoint<Result, Visitor>,
+        &VisitString<Result, Visitor>,
+        &VisitArray<Result, Visitor>,
+        &VisitDictionary<Result, Visitor>,
+        &VisitClosure<Result, Visitor>,
+        &VisitWeakReference<Result, Visitor>,
+        &VisitNull<Result, Visitor>,
+        &VisitString<Result, Visitor>,
+    };
+
+    Value *value = tryDereference();
+    return visits[static_cast<int>(value->getType())](value, visitor);
+}
+
+
+void
+Value::share()
+{
+    if (hasValueData()) {
+        getValueData()->share();
+    }
+}
+
+
+void
+Value::makeImmortal()
+{
+    if (hasValueData()) {
+#if defined(KARINA_NURSERY)
+        // Young objects cannot be immortal, as the nursery gets emptied.
+        if (GarbageCollector::IsYoung(getValueData())) {
+            setValueData(GarbageCollector::Promote(getValueData()));
+        }
+#endif
+#if defined(KARINA_INCREMENTAL_MARKING)
+        // Marking may be under way with nothing else holding it.
+        GarbageCollector::MarkingBarrier(*this);
+#endif
+        getValueData()->makeImmortal();
+    }
+}
+
+
+#define VALUE_TYPE_TESTER(valueType)          \
+    bool                                      \
+    Value::is##valueType() const              \
+    {                                         \
+        assert(getType() != Type::Reference); \
+        return getType() == Type::valueType;  \
+    }
+
+VALUE_TYPE_TESTER(Null)
+VALUE_TYPE_TESTER(Boolean)
+VALUE_TYPE_TESTER(Integer)
+VALUE_TYPE_TESTER(FloatingPoint)
+VALUE_TYPE_TESTER(Array)
+VALUE_TYPE_TESTER(Dictionary)
+VALUE_TYPE_TESTER(Closure)
+VALUE_TYPE_TESTER(WeakReference)
+
+#undef VALUE_TYPE_TESTER
+
+
+bool
+Value::isString() const
+{
+    assert(getType() != Type::Reference);
+    return getType() == Type::String || getType() == Type::ShortString;
+}
+
+
+#define VALUE_DATA_GETTER(valueType)                           \
+    valueType *                                                \
+    Value::get##valueType()                                    \
+    {                                                          \
+        assert(getType() == Type::valueType);                  \
+        return static_cast<valueType *>(getValueData());       \
+    }
+
+VALUE_DATA_GETTER(Array)
+VALUE_DATA_GETTER(Dictionary)
+VALUE_DATA_GETTER(Closure)
+VALUE_DATA_GETTER(WeakReference)
+
+#undef VALUE_DATA_GETTER
+
+
+String *
+Value::getString()
+{
+    assert(isString());
+    return getType() == Type::String ? static_cast<String *>(getValueData()) : nullptr;
+}
+
+
+std::size_t
+Value::getStringLength() const
+{
+    assert(isString());
+    return getType() == Type::String ? static_cast<String *>(getValueData())->getLength()
+                                     : getShortStringLength();
+}
+
+
+char *
+Value::getStringCharacters(std::size_t *length)
+{
+    assert(isString());
+
+    if (getType() == Type::String) {
+        String *string = static_cast<String *>(getValueData());
+        *length = string->getLength();
+        return string->getCharacters();
+    } else {
+        *length = getShortStringLength();
+        return getShortString();
+    }
+}
+
+
+bool
+Value::hasValueData() const
+{
+    return static_cast<unsigned int>(getType()) - static_cast<unsigned int>(Type::String)
+           < static_cast<unsigned int>(Type::Reference) - static_cast<unsigned int>(Type::String);
+}
+
+
+#define VALUE_VISITOR(valueType, ...)                             \
+    template<class Result, class Visitor>                         \
+    Result                                                        \
+    Value::Visit##valueType(Value *value, Visitor &visitor)       \
+    {                                                             \
+        static_cast<void>(value);                                 \
+        return visitor(__VA_ARGS__);                              \
+    }
+
+VALUE_VISITOR(Null, nullptr)
+VALUE_VISITOR(Boolean, value->getBoolean())
+VALUE_VISITOR(Integer, value->getInteger())
+VALUE_VISITOR(FloatingPoint, value->getFloatingPoint())
+VALUE_VISITOR(Array, value->getArray())
+VALUE_VISITOR(Dictionary, value->getDictionary())
+VALUE_VISITOR(Closure, value->getClosure())
+VALUE_VISITOR(WeakReference, value->getWeakReference())
+
+#undef VALUE_VISITOR
+
+
+template<class Result, class Visitor>
+Result
+Value::VisitString(Value *value, Visitor &visitor)
+{
+    std::size_t length;
+    char *characters = value->getStringCharacters(&length);
+    return visitor(characters, length);
+}
+
+
+ValueRef::ValueRef(Value &value)
+  : value_(value.tryDereference())
+{
+}
+
+
+Value
+ValueRef::toValue() const
+{
+    return *value_;
+}
+
+
+#define VALUE_REF_TYPE_TESTER(valueType) \
+    bool                                 \
+    ValueRef::is##valueType() const      \
+    {                                    \
+        return value_->is##valueType();  \
+    }
+
+VALUE_REF_TYPE_TESTER(Null)
+VALUE_REF_TYPE_TESTER(Boolean)
+VALUE_REF_TYPE_TESTER(Integer)
+VALUE_REF_TYPE_TESTER(FloatingPoint)
+VALUE_REF_TYPE_TESTER(String)
+VALUE_REF_TYPE_TESTER(Array)
+VALUE_REF_TYPE_TESTER(Dictionary)
+VALUE_REF_TYPE_TESTER(Closure)
+VALUE_REF_TYPE_TESTER(WeakReference)
+
+#undef VALUE_REF_TYPE_TESTER
+
+
+#define VALUE_REF_DATA_GETTER(valueType, valueDataT) \
+    valueDataT                                       \
+    ValueRef::get##valueType() const                 \
+    {                                                \
+        return value_->get##valueType();             \
+    }
+
+VALUE_REF_DATA_GETTER(Boolean, bool *)
+VALUE_REF_DATA_GETTER(Integer, Value::IntegerPointer)
+VALUE_REF_DATA_GETTER(FloatingPoint, Value::FloatingPointPointer)
+VALUE_REF_DATA_GETTER(String, String *)
+VALUE_REF_DATA_GETTER(Array, Array *)
+VALUE_REF_DATA_GETTER(Dictionary, Dictionary *)
+VALUE_REF_DATA_GETTER(Closure, Closure *)
+VALUE_REF_DATA_GETTER(WeakReference, WeakReference *)
+
+#undef VALUE_REF_DATA_GETTER
+
+
+char *
+ValueRef::getStringCharacters(std::size_t *length) const
+{
+    return value_->getStringCharacters(length);
+}
+
+
+ValueData::ValueData(Type type)
+  : type_(type),
+    flags_(0)
+{
+#if defined(KARINA_MARK_SWEEP)
+    if (GarbageCollector::IsYoung(this)) {
+        next_ = nullptr;
+    } else {
+        GarbageCollector *garbageCollector = GarbageCollector::Get();
+        next_ = garbageCollector->objects_;
+        garbageCollector->objects_ = this;
+#   if defined(KARINA_INCREMENTAL_MARKING)
+        // Scanned once it is done with.
+        if (garbageCollector->phase_ == GarbageCollector::Phase::Marking) {
+            garbageCollector->shade(this);
+        }
+#   endif
+    }
+#endif
+#if defined(KARINA_ARENA_SCOPES)
+    // It was made by ArenaScope::Allocate().
+    if (ArenaScope::GetCurrent() != nullptr) {
+        flags_ = kRegionalFlag;
+    }
+#endif
+}
+
+
+constexpr
+ValueData::ValueData(Type type, ImmortalTag immortalTag)
+  : copyCounter_(immortalTag),
+    type_(type),
+    flags_(kImmortalFlag)
+#if defined(KARINA_MARK_SWEEP)
+    , next_(nullptr)
+#endif
+{
+}
+
+
+void *
+ValueData::operator new(std::size_t size)
+{
+    return Allocate(size);
+}
+
+
+void
+ValueData::operator delete(void *valueData, std::size_t size)
+{
+#if defined(KARINA_MEMORY_QUOTA)
+    MemoryQuota::Credit(size);
+#endif
+    Pool::Free(valueData, size);
+}
+
+
+ValueData *
+ValueData::copy()
+{
+    if ((flags_ & kUncountedFlags) == 0) {
+        copyCounter_.increment();
+    }
+
+    return this;
+}
+
+
+void
+ValueData::destroy()
+{
+    if ((flags_ & kUncountedFlags) == 0 && copyCounter_.decrement()) {
+        release();
+        return;
+    } else {
+#if defined(KARINA_CYCLE_COLLECTOR)
+        if ((flags_ & (kUncountedFlags | kBufferedFlag)) == 0 && type_ != Type::String
+            && type_ != Type::WeakReference) {
+            CycleCollector::AddCandidate(this);
+        }
+#endif
+        return;
+    }
+}
+
+
+void
+ValueData::share()
+{
+    if ((flags_ & kUncountedFlags) != 0) {
+        return;
+    }
+
+    // Whatever it refers to is shared along with it the first time, since
+    // sharing drops it from the side tables whichever counter is in use.
+    bool isNewlyShared = (flags_ & kSharedFlag) == 0;
+
+    if (isNewlyShared) {
+        // Another thread would release it against its own tables.
+        if ((flags_ & kWeaklyReferencedFlag) != 0) {
+            WeakReference::Clear(this);
+        }
+
+        if (type_ == Type::String) {
+            String *string = static_cast<String *>(this);
+            // Threads must not race to flatten, classify or hash it either.
+            string->getCharacters();
+            string->classify();
+            string->getHash();
+
+            if ((flags_ & kInternedFlag) != 0) {
+                String::Unintern(string);
+            }
+
+            if ((flags_ & kIndexedFlag) != 0) {
+                String::Unindex(string);
+            }
+        } else if (type_ == Type::WeakReference) {
+            static_cast<WeakReference *>(this)->detach();
+        }
+
+        flags_ |= kSharedFlag;
+    }
+
+    if (copyCounter_.share() || isNewlyShared) {
+        if (type_ == Type::Array) {
+            Array *array = static_cast<Array *>(this);
+            Value *elements = array->getElements();
+
+            for (std::size_t i = 0; i < array->getLength(); ++i) {
+                elements[i].share();
+            }
+        } else if ((flags_ & kConcatenationFlag) != 0) {
+            // Flattened above, which leaves the left half only.
+            static_cast<String *>(this)->getConcatenation()->left.share();
+        } else if ((flags_ & kSliceFlag) != 0) {
+            String *string = static_cast<String *>(this);
+
+            // Long-lived, most likely.
+            if (string->length_ * String::kCompactionRatio
+                <= string->getSlice()->parent.getString()->length_) {
+                string->compact();
+            }
+
+            string->getSlice()->parent.share();
+        }
+    }
+}
+
+
+void *
+ValueData::Allocate(std::size_t size)
+{
+#if defined(KARINA_MEMORY_QUOTA)
+    // May throw, before anything is allocated.
+    MemoryQuota::Charge(size);
+#endif
+
+#if defined(KARINA_ARENA_SCOPES)
+    if (void *block = ArenaScope::Allocate(size)) {
+        return block;
+    }
+#endif
+
+#if defined(KARINA_CYCLE_COLLECTOR)
+    CycleCollector::NotifyAllocation(size);
+    return Pool::Allocate(size);
+#elif defined(KARINA_MARK_SWEEP)
+    return GarbageCollector::Allocate(size);
+#else
+    return Pool::Allocate(size);
+#endif
+}
+
+
+void
+ValueData::makeImmortal()
+{
+    // Static objects are immortal already, and may be in read-only memory.
+    if ((flags_ & kImmortalFlag) != 0) {
+        return;
+    }
+
+    // The arena would free it all the same, it has to be escaped first.
+    assert((flags_ & kRegionalFlag) == 0);
+
+    // Neither is ever stored once it is immortal.
+    if (type_ == Type::String) {
+        static_cast<String *>(this)->classify();
+        static_cast<String *>(this)->getHash();
+    }
+
+    flags_ |= kImmortalFlag;
+}
+
+
+std::size_t
+ValueData::getSize() const
+{
+    switch (type_) {
+    case Type::String:
+        return static_cast<const String *>(this)->getSize();
+
+    case Type::Array:
+        return static_cast<const Array *>(this)->getSize();
+
+    case Type::Dictionary:
+        return sizeof(Dictionary);
+
+    case Type::Closure:
+        return sizeof(Closure);
+
+    case Type::WeakReference:
+        return sizeof(WeakReference);
+    }
+
+    assert(false);
+    return 0;
+}
+
+
+void
+ValueData::release()
+{
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyReleased(this);
+#endif
+
+    if ((flags_ & kWeaklyReferencedFlag) != 0) {
+        WeakReference::Clear(this);
+    }
+
+    if ((flags_ & kInternedFlag) != 0) {
+        String::Unintern(static_cast<String *>(this));
+    }
+
+    if ((flags_ & kIndexedFlag) != 0) {
+        String::Unindex(static_cast<String *>(this));
+    }
+
+#if defined(KARINA_DEFERRED_RELEASE)
+    // Weak references hold nothing counted, and strings no more than a
+    // shallow tree of strings, so releasing them on the spot cannot run out
+    // of stack.
+    if (type_ != Type::String && type_ != Type::WeakReference) {
+        ReleaseQueue::Get()->push(this);
+        return;
+    }
+#endif
+
+    switch (type_) {
+    case Type::String:
+        String::Delete(static_cast<String *>(this));
+        break;
+
+    case Type::Array:
+        Array::Delete(static_cast<Array *>(this));
+        break;
+
+    case Type::Dictionary:
+        delete static_cast<Dictionary *>(this);
+        break;
+
+    case Type::Closure:
+        delete static_cast<Closure *>(this);
+        break;
+
+    case Type::WeakReference:
+        delete static_cast<WeakReference *>(this);
+        break;
+    }
+}
+
+
+void
+BiasedCopyCounter::Release(BiasedCopyCounter *copyCounter)
+{
+    static_assert(std::is_standard_layout<ValueData>::value,
+                  "ValueData must be pointer-interconvertible with its copy counter");
+    reinterpret_cast<ValueData *>(copyCounter)->release();
+}
+
+
+#if defined(KARINA_HEAP_STATISTICS)
+void
+Heap::NotifyMade(const ValueData *valueData)
+{
+    HeapTypeStatistics &typeStatistics = Get()->typeStatistics_[static_cast<int>(valueData->type_)];
+    std::size_t size = valueData->getSize();
+    ++typeStatistics.allocationCount;
+    typeStatistics.allocatedByteCount += size;
+
+    if (++typeStatistics.liveCount > typeStatistics.peakLiveCount) {
+        typeStatistics.peakLiveCount = typeStatistics.liveCount;
+    }
+
+    if ((typeStatistics.liveByteCount += size) > typeStatistics.peakLiveByteCount) {
+        typeStatistics.peakLiveByteCount = typeStatistics.liveByteCount;
+    }
+}
+
+
+void
+Heap::NotifyReleased(const ValueData *valueData)
+{
+    HeapTypeStatistics &typeStatistics = Get()->typeStatistics_[static_cast<int>(valueData->type_)];
+    --typeStatistics.liveCount;
+    typeStatistics.liveByteCount -= valueData->getSize();
+}
+#endif // defined(KARINA_HEAP_STATISTICS)
+
+
+bool
+Heap::WriteSnapshot(std::ostream &stream, const Value *roots, std::size_t rootCount)
+{
+    std::unordered_map<ValueData *, std::uint64_t> ids;
+    // Found but not written out yet.
+    std::vector<ValueData *> stack;
+
+    auto getId = [&] (ValueData *valueData) -> std::uint64_t {
+        auto id = ids.emplace(valueData, ids.size());
+
+        if (id.second) {
+            stack.push_back(valueData);
+        }
+
+        return id.first->second;
+    };
+
+    auto writeRoot = [&] (ValueData *valueData) -> void {
+        stream.put(kRootRecord);
+        WriteVarint(stream, getId(valueData));
+    };
+
+    auto writeRoots = [&] (const Value *values, std::size_t length) -> void {
+        for (std::size_t i = 0; i < length; ++i) {
+            if (values[i].hasValueData()) {
+                writeRoot(values[i].getValueData());
+            }
+        }
+    };
+
+    stream.write("KHS1", 4);
+    writeRoots(roots, rootCount);
+#if defined(KARINA_MARK_SWEEP)
+    GarbageCollector *garbageCollector = GarbageCollector::Get();
+
+    for (const std::pair<Value *, std::size_t> &root : garbageCollector->roots_) {
+        writeRoots(root.first, root.second);
+    }
+
+    // Objects made immortal at run time are roots too, as for marking.
+    // Those not swept yet are still in the detached list.
+    ValueData *objectLists[] = {garbageCollector->objects_, garbageCollector->unsweptObjects_};
+
+    for (ValueData *objects : objectLists) {
+        for (ValueData *valueData = objects; valueData != nullptr; valueData = valueData->next_) {
+            if ((valueData->flags_ & ValueData::kImmortalFlag) != 0) {
+                writeRoot(valueData);
+            }
+        }
+    }
+#endif
+    // Element indices and ids.
+    std::vector<std::pair<std::size_t, std::uint64_t>> edges;
+
+    while (!stack.empty()) {
+        ValueData *valueData = stack.back();
+        stack.pop_back();
+        edges.clear();
+
+        if (valueData->type_ == ValueData::Type::Array) {
+            Array *array = static_cast<Array *>(valueData);
+            Value *elements = array->getElements();
+
+            for (std::size_t i = 0; i < array->getLength(); ++i) {
+                if (elements[i].hasValueData()) {
+                    edges.emplace_back(i, getId(elements[i].getValueData()));
+                }
+            }
+        } else if ((valueData->flags_ & ValueData::kConcatenationFlag) != 0) {
+            String::Concatenation *concatenation = static_cast<String *>(valueData)->getConcatenation();
+            edges.emplace_back(0, getId(concatenation->left.getValueData()));
+
+            if (!concatenation->right.isNull()) {
+                edges.emplace_back(1, getId(concatenation->right.getValueData()));
+            }
+        } else if ((valueData->flags_ & ValueData::kSliceFlag) != 0) {
+            String::Slice *slice = static_cast<String *>(valueData)->getSlice();
+            edges.emplace_back(0, getId(slice->parent.getValueData()));
+        }
+
+        unsigned char flags = 0;
+
+        if ((valueData->flags_ & ValueData::kImmortalFlag) != 0) {
+            flags |= kSnapshotImmortalFlag;
+        }
+
+        if ((valueData->flags_ & ValueData::kRegionalFlag) != 0) {
+            flags |= kSnapshotRegionalFlag;
+        }
+
+        stream.put(kObjectRecord);
+        WriteVarint(stream, ids.at(valueData));
+        stream.put(static_cast<char>(valueData->type_));
+        stream.put(static_cast<char>(flags));
+        WriteVarint(stream, valueData->getSize());
+        WriteVarint(stream, edges.size());
+
+        for (const std::pair<std::size_t, std::uint64_t> &edge : edges) {
+            WriteVarint(stream, edge.first);
+            WriteVarint(stream, edge.second);
+        }
+    }
+
+    stream.put(kEndRecord);
+    return stream.good();
+}
+
+
+#if defined(KARINA_DEFERRED_RELEASE)
+void
+ValueData::MakeThreadLocals()
+{
+    Pool::GetStatistics(0);
+    CopyCounter::MergeQueued();
+#   if defined(KARINA_MEMORY_QUOTA)
+    MemoryQuota::Get();
+#   endif
+#   if defined(KARINA_HEAP_STATISTICS)
+    Heap::Get();
+#   endif
+#   if defined(KARINA_CYCLE_COLLECTOR)
+    CycleCollector::Get();
+#   endif
+    String::GetTable();
+    String::GetCodepointIndices();
+    WeakReference::GetTable();
+}
+
+
+ReleaseQueue::ReleaseQueue()
+  : budget_(kDefaultBudget),
+    isDraining_(false)
+{
+    // Thread-local objects are destroyed in the reverse order of their
+    // construction, so whatever draining at thread exit touches is made
+    // first.
+    ValueData::MakeThreadLocals();
+}
+
+
+void
+ReleaseQueue::push(ValueData *valueData)
+{
+    entries_.push_back({valueData, 0});
+
+    if (!isDraining_) {
+        drain(budget_);
+    }
+}
+
+
+bool
+ReleaseQueue::drain(std::size_t budget)
+{
+    typedef ValueData::Type Type;
+
+    // Releases made meanwhile only get queued, keeping the stack flat.
+    bool isDraining = isDraining_;
+    isDraining_ = true;
+
+    for (; budget >= 1 && !entries_.empty(); --budget) {
+        // Destroying an element may push onto the queue, so entries are
+        // not held by reference.
+        std::size_t top = entries_.size() - 1;
+        ValueData *valueData = entries_[top].valueData;
+
+        if (valueData->type_ == Type::Array) {
+            Array *array = static_cast<Array *>(valueData);
+
+            if (entries_[top].index < array->getLength()) {
+                array->getElements()[entries_[top].index++].~Value();
+                continue;
+            }
+        }
+
+        entries_.pop_back();
+
+        switch (valueData->type_) {
+        case Type::String:
+        case Type::WeakReference:
+            assert(false);
+            break;
+
+        case Type::Array:
+            Array::Deallocate(static_cast<Array *>(valueData));
+            break;
+
+        case Type::Dictionary:
+            delete static_cast<Dictionary *>(valueData);
+            break;
+
+        case Type::Closure:
+            delete static_cast<Closure *>(valueData);
+            break;
+        }
+    }
+
+    isDraining_ = isDraining;
+    return entries_.empty();
+}
+#endif // defined(KARINA_DEFERRED_RELEASE)
+
+
+#if defined(KARINA_MEMORY_QUOTA)
+void
+MemoryQuota::reclaim()
+{
+#   if defined(KARINA_DEFERRED_RELEASE)
+    ReleaseQueue::Drain();
+#   endif
+#   if defined(KARINA_CYCLE_COLLECTOR)
+    CycleCollector *cycleCollector = CycleCollector::Get();
+
+    if (!cycleCollector->isCollecting_) {
+        cycleCollector->collect();
+    }
+#   elif defined(KARINA_MARK_SWEEP)
+    // Collecting has to wait for a safepoint.
+    GarbageCollector *garbageCollector = GarbageCollector::Get();
+
+    if (garbageCollector->allocatedSize_ < garbageCollector->threshold_) {
+        garbageCollector->allocatedSize_ = garbageCollector->threshold_;
+    }
+#   endif
+
+    if (softLimitListener_ != nullptr) {
+        softLimitListener_(usedSize_);
+    }
+}
+#endif // defined(KARINA_MEMORY_QUOTA)
+
+
+#if defined(KARINA_ARENA_SCOPES)
+Value
+ArenaScope::Escape(const Value &value)
+{
+    typedef ValueData::Type Type;
+
+    // The copies go to the heap, even from within a scope.
+    Bypass bypass;
+    // From the objects of arenas to their copies, so that sharing and
+    // cycles are kept.
+    std::unordered_map<ValueData *, ValueData *> copies;
+    // Copies whose elements are yet to be filled in, along with the arrays
+    // they were copied from.
+    std::vector<std::pair<Array *, Array *>> arrays;
+
+    auto escape = [&] (const Value &value) -> Value {
+        // Copying a value of an arena leaves the copy count alone.
+        Value result(value);
+
+        if (!value.hasValueData()
+            || (value.getValueData()->flags_ & ValueData::kRegionalFlag) == 0) {
+            return result;
+        }
+
+        ValueData *valueData = value.getValueData();
+        auto copy = copies.emplace(valueData, nullptr);
+
+        if (!copy.second) {
+            result.setValueData(copy.first->second->copy());
+            return result;
+        }
+
+        switch (valueData->type_) {
+        case Type::String:
+        {
+            String *string = static_cast<String *>(valueData);
+            copy.first->second = String::New(string->getCharacters(), string->getLength());
+            break;
+        }
+
+        case Type::Array:
+        {
+            Array *array = static_cast<Array *>(valueData);
+            Array *arrayCopy = Array::NewOfLength(array->getLength());
+            arrays.emplace_back(arrayCopy, array);
+            copy.first->second = arrayCopy;
+            break;
+        }
+
+        case Type::Dictionary:
+            copy.first->second = new Dictionary();
+            break;
+
+        case Type::Closure:
+            copy.first->second = new Closure();
+            break;
+
+        case Type::WeakReference:
+            // Never made in an arena.
+            assert(false);
+            break;
+        }
+
+        result.setValueData(copy.first->second);
+        return result;
+    };
+
+    Value result = escape(value);
+
+    while (!arrays.empty()) {
+        Array *arrayCopy = arrays.back().first;
+        Array *array = arrays.back().second;
+        arrays.pop_back();
+
+        for (std::size_t i = 0; i < array->getLength(); ++i) {
+            arrayCopy->getElements()[i] = escape(array->getElements()[i]);
+        }
+    }
+
+    return result;
+}
+
+
+void
+ArenaScope::release()
+{
+    typedef ValueData::Type Type;
+
+    // Flat strings hold nothing, everything else may hold copies of objects
+    // on the heap.
+    for (Chunk *chunk = chunks_; chunk != nullptr; chunk = chunk->next) {
+        char *object = reinterpret_cast<char *>(chunk + 1);
+
+        while (object < chunk->end) {
+            auto valueData = reinterpret_cast<ValueData *>(object);
+            object += (valueData->getSize() + 7) & ~static_cast<std::size_t>(7);
+#   if defined(KARINA_HEAP_STATISTICS)
+            Heap::NotifyReleased(valueData);
+#   endif
+#   if defined(KARINA_MEMORY_QUOTA)
+            MemoryQuota::Credit(valueData->getSize());
+#   endif
+
+            if ((valueData->flags_ & ValueData::kWeaklyReferencedFlag) != 0) {
+                WeakReference::Clear(valueData);
+            }
+
+            if ((valueData->flags_ & ValueData::kIndexedFlag) != 0) {
+                String::Unindex(static_cast<String *>(valueData));
+            }
+
+            switch (valueData->type_) {
+            case Type::String:
+                if ((valueData->flags_ & ValueData::kConcatenationFlag) != 0) {
+                    static_cast<String *>(valueData)->getConcatenation()->~Concatenation();
+                } else if ((valueData->flags_ & ValueData::kSliceFlag) != 0) {
+                    static_cast<String *>(valueData)->getSlice()->~Slice();
+                }
+
+                break;
+
+            case Type::Array:
+            {
+                Array *array = static_cast<Array *>(valueData);
+                Value *elements = array->getElements();
+
+                for (std::size_t i = 0; i < array->getLength(); ++i) {
+                    elements[i].~Value();
+                }
+
+                break;
+            }
+
+            case Type::Dictionary:
+                static_cast<Dictionary *>(valueData)->~Dictionary();
+                break;
+
+            case Type::Closure:
+                static_cast<Closure *>(valueData)->~Closure();
+                break;
+
+            case Type::WeakReference:
+                assert(false);
+                break;
+            }
+        }
+    }
+}
+#endif // defined(KARINA_ARENA_SCOPES)
+
+
+#if defined(KARINA_CYCLE_COLLECTOR)
+void
+CycleCollector::AddCandidate(ValueData *valueData)
+{
+    valueData->copyCounter_.increment();
+    valueData->flags_ |= ValueData::kBufferedFlag;
+    Get()->candidates_.push_back(valueData);
+}
+
+
+void
+CycleCollector::NotifyAllocation(std::size_t size)
+{
+    CycleCollector *cycleCollector = Get();
+    cycleCollector->allocatedSize_ += size;
+
+    if (cycleCollector->threshold_ >= 1
+        && cycleCollector->allocatedSize_ >= cycleCollector->threshold_
+        && !cycleCollector->isCollecting_) {
+        cycleCollector->collect();
+    }
+}
+
+
+CycleCollectorStatistics
+CycleCollector::collect()
+{
+    // The side table starts out with the number of copies of each object,
+    // and ends up with kLive or kGarbage.
+    static constexpr long kLive = -1;
+    static constexpr long kGarbage = -2;
+
+    typedef ValueData::Type Type;
+
+    // Calls the function with every container held by the object.
+    auto forEachChild = [] (ValueData *valueData, auto function) -> void {
+        if (valueData->type_ == Type::Array) {
+            Array *array = static_cast<Array *>(valueData);
+            Value *elements = array->getElements();
+
+            for (std::size_t i = 0; i < array->getLength(); ++i) {
+                if (elements[i].hasValueData()) {
+                    ValueData *child = elements[i].getValueData();
+
+                    if ((child->flags_ & ValueData::kUncountedFlags) == 0
+                        && child->type_ != Type::String
+                        && child->type_ != Type::WeakReference) {
+                        function(child);
+                    }
+                }
+            }
+        }
+    };
+
+#if defined(KARINA_DEFERRED_RELEASE)
+    // Queued objects still hold copies of what they refer to.
+    ReleaseQueue::Drain();
+#endif
+
+    CycleCollectorStatistics statistics = {1, 0, 0, 0};
+    std::vector<ValueData *> candidates;
+    isCollecting_ = true;
+    allocatedSize_ = 0;
+    candidates.swap(candidates_);
+
+    // Releasing a candidate may leave another one held by the buffer only.
+    // Containers let go of meanwhile are buffered for the next collection.
+    for (bool isReleasing = true; isReleasing;) {
+        std::size_t j = 0;
+        isReleasing = false;
+
+        for (ValueData *candidate : candidates) {
+            if (candidate->copyCounter_.getCount() == 0) {
+                candidate->flags_ &= ~ValueData::kBufferedFlag;
+                candidate->release();
+                isReleasing = true;
+            } else {
+                candidates[j++] = candidate;
+            }
+        }
+
+        candidates.resize(j);
+    }
+
+    std::unordered_map<ValueData *, long> copyCounts;
+    std::vector<ValueData *> stack;
+
+    // Not counting the copy held by the buffer.
+    for (ValueData *candidate : candidates) {
+        copyCounts.emplace(candidate, candidate->copyCounter_.getCount());
+        stack.push_back(candidate);
+    }
+
+    while (!stack.empty()) {
+        ValueData *valueData = stack.back();
+        stack.pop_back();
+
+        forEachChild(valueData, [&] (ValueData *child) -> void {
+            auto result = copyCounts.emplace(child, child->copyCounter_.getCount() + 1);
+
+            if (result.second) {
+                stack.push_back(child);
+            }
+
+            --result.first->second;
+        });
+    }
+
+    for (auto &copyCount : copyCounts) {
+        if (copyCount.second >= 1) {
+            copyCount.second = kLive;
+            stack.push_back(copyCount.first);
+        }
+    }
+
+    while (!stack.empty()) {
+        ValueData *valueData = stack.back();
+        stack.pop_back();
+
+        forEachChild(valueData, [&] (ValueData *child) -> void {
+            long &copyCount = copyCounts.at(child);
+
+            if (copyCount != kLive) {
+                copyCount = kLive;
+                stack.push_back(child);
+            }
+        });
+    }
+
+    // Every garbage object is reachable from a garbage candidate. Counting
+    // what each candidate reaches first as one cycle.
+    std::vector<ValueData *> garbage;
+
+    for (ValueData *candidate : candidates) {
+        if (copyCounts.at(candidate) == 0) {
+            copyCounts.at(candidate) = kGarbage;
+            stack.push_back(candidate);
+            ++statistics.cycleCount;
+        }
+
+        while (!stack.empty()) {
+            ValueData *valueData = stack.back();
+            stack.pop_back();
+            garbage.push_back(valueData);
+
+            forEachChild(valueData, [&] (ValueData *child) -> void {
+                long &copyCount = copyCounts.at(child);
+
+                if (copyCount == 0) {
+                    copyCount = kGarbage;
+                    stack.push_back(child);
+                }
+            });
+        }
+    }
+
+    // Holding on to the garbage while it lets go of everything it holds, so
+    // that none of it gets released halfway. The flag keeps it from being
+    // buffered again meanwhile.
+    for (ValueData *valueData : garbage) {
+        valueData->copyCounter_.increment();
+        valueData->flags_ |= ValueData::kBufferedFlag;
+        ++statistics.objectCount;
+        statistics.byteCount += valueData->getSize();
+    }
+
+    for (ValueData *valueData : garbage) {
+        if (valueData->type_ == Type::Array) {
+            Array *array = static_cast<Array *>(valueData);
+            Value *elements = array->getElements();
+
+            for (std::size_t i = 0; i < array->getLength(); ++i) {
+                elements[i] = Value();
+            }
+        }
+    }
+
+    // Without going through destroy(), which would buffer them again.
+    for (ValueData *candidate : candidates) {
+        candidate->flags_ &= ~ValueData::kBufferedFlag;
+
+        if (candidate->copyCounter_.decrement()) {
+            candidate->release();
+        }
+    }
+
+    for (ValueData *valueData : garbage) {
+        valueData->flags_ &= ~ValueData::kBufferedFlag;
+        bool isReleasing = valueData->copyCounter_.decrement();
+        assert(isReleasing);
+        static_cast<void>(isReleasing);
+        valueData->release();
+    }
+
+    isCollecting_ = false;
+    ++statistics_.collectionCount;
+    statistics_.cycleCount += statistics.cycleCount;
+    statistics_.objectCount += statistics.objectCount;
+    statistics_.byteCount += statistics.byteCount;
+    return statistics;
+}
+#endif // defined(KARINA_CYCLE_COLLECTOR)
+
+
+#if defined(KARINA_MARK_SWEEP)
+GarbageCollectorStatistics
+GarbageCollector::collect()
+{
+    if (phase_ == Phase::Idle) {
+        startMarking();
+    }
+
+    if (phase_ == Phase::Marking) {
+        mark(Clock::time_point::max());
+        finishMarking();
+    }
+
+    sweep(Clock::time_point::max());
+    GarbageCollectorStatistics statistics = GarbageCollectorStatistics();
+    statistics.collectionCount = 1;
+    statistics.objectCount = freedObjectCount_;
+    statistics.byteCount = freedByteCount_;
+    return statistics;
+}
+
+
+void
+GarbageCollector::shade(ValueData *valueData)
+{
+    // Immortal objects are never marked, they may be in read-only memory.
+    // Young ones are reached once promoted.
+    if ((valueData->flags_ & (ValueData::kImmortalFlag | ValueData::kMarkedFlag)) == 0
+        && !IsYoung(valueData)) {
+        valueData->flags_ |= ValueData::kMarkedFlag;
+        grayObjects_.push_back(valueData);
+    }
+}
+
+
+void
+GarbageCollector::startMarking()
+{
+    assert(phase_ == Phase::Idle);
+#if defined(KARINA_NURSERY)
+    collectYoung();
+#endif
+    phase_ = Phase::Marking;
+    allocatedSize_ = 0;
+    freedObjectCount_ = 0;
+    freedByteCount_ = 0;
+
+    for (const std::pair<Value *, std::size_t> &root : roots_) {
+        for (std::size_t i = 0; i < root.second; ++i) {
+            if (root.first[i].hasValueData()) {
+                shade(root.first[i].getValueData());
+            }
+        }
+    }
+
+    // Objects made immortal at run time are roots too.
+    for (ValueData *valueData = objects_; valueData != nullptr; valueData = valueData->next_) {
+        if ((valueData->flags_ & ValueData::kImmortalFlag) != 0) {
+            grayObjects_.push_back(valueData);
+        }
+    }
+}
+
+
+bool
+GarbageCollector::mark(Clock::time_point deadline)
+{
+    for (std::size_t i = 1; !grayObjects_.empty(); ++i) {
+        if (i % kStepLength == 0 && Clock::now() >= deadline) {
+            return false;
+        }
+
+        ValueData *valueData = grayObjects_.back();
+        grayObjects_.pop_back();
+
+        if (valueData->type_ == ValueData::Type::Array) {
+            Array *array = static_cast<Array *>(valueData);
+            Value *elements = array->getElements();
+
+            for (std::size_t j = 0; j < array->getLength(); ++j) {
+                if (elements[j].hasValueData()) {
+                    shade(elements[j].getValueData());
+                }
+            }
+        } else if ((valueData->flags_ & ValueData::kConcatenationFlag) != 0) {
+            String::Concatenation *concatenation = static_cast<String *>(valueData)->getConcatenation();
+            shade(concatenation->left.getValueData());
+
+            if (!concatenation->right.isNull()) {
+                shade(concatenation->right.getValueData());
+            }
+        } else if ((valueData->flags_ & ValueData::kSliceFlag) != 0) {
+            auto slice = static_cast<String *>(valueData);
+            String *parent = slice->getSlice()->parent.getString();
+
+            // Whether anything else holds the parent is known only once
+            // marking is done.
+            if (slice->length_ * String::kCompactionRatio <= parent->length_) {
+                slices_.push_back(slice);
+            } else {
+                shade(parent);
+            }
+        }
+    }
+
+    return true;
+}
+
+
+void
+GarbageCollector::finishMarking()
+{
+    // The roots may have been written to without the barrier, and the
+    // nursery may hold the last copies of unmarked objects.
+    for (const std::pair<Value *, std::size_t> &root : roots_) {
+        for (std::size_t i = 0; i < root.second; ++i) {
+            if (root.first[i].hasValueData()) {
+                shade(root.first[i].getValueData());
+            }
+        }
+    }
+
+#if defined(KARINA_NURSERY)
+    collectYoung();
+#endif
+    mark(Clock::time_point::max());
+
+    // Slices of parents reached through nothing else get characters of
+    // their own, unless they add up to too much of them.
+    std::unordered_map<String *, std::size_t> slicedLengths;
+
+    for (String *slice : slices_) {
+        String *parent = slice->getSlice()->parent.getString();
+
+        if ((parent->flags_ & (ValueData::kImmortalFlag | ValueData::kMarkedFlag)) == 0
+            && !IsYoung(parent)) {
+            slicedLengths[parent] += slice->length_;
+        }
+    }
+
+    for (String *slice : slices_) {
+        String *parent = slice->getSlice()->parent.getString();
+        auto slicedLength = slicedLengths.find(parent);
+
+        if (slicedLength == slicedLengths.end()) {
+            continue;
+        } else if (slicedLength->second * String::kCompactionRatio <= parent->length_) {
+            slice->compact();
+            shade(slice->getSlice()->parent.getValueData());
+        } else {
+            shade(parent);
+        }
+    }
+
+    slices_.clear();
+    mark(Clock::time_point::max());
+
+    // Weak references to whatever is about to be swept are cleared now,
+    // get() must not hand out such objects meanwhile. Neither must
+    // WeakReference::Make() hand out weak references about to be swept.
+    std::unordered_map<ValueData *, WeakReference *> &table = WeakReference::GetTable();
+    unsigned short liveFlags = ValueData::kImmortalFlag | ValueData::kMarkedFlag;
+
+    for (auto entry = table.begin(); entry != table.end();) {
+        ValueData *valueData = entry->first;
+
+        if ((valueData->flags_ & liveFlags) == 0 || (entry->second->flags_ & liveFlags) == 0) {
+            new (&entry->second->value_) Value();
+            valueData->flags_ &= ~ValueData::kWeaklyReferencedFlag;
+            entry = table.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+
+    // Likewise, interning must not hand them out.
+    std::unordered_multimap<std::size_t, String *> &strings = String::GetTable();
+
+    for (auto entry = strings.begin(); entry != strings.end();) {
+        String *string = entry->second;
+
+        if ((string->flags_ & (ValueData::kImmortalFlag | ValueData::kMarkedFlag)) == 0) {
+            string->flags_ &= ~ValueData::kInternedFlag;
+            entry = strings.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+
+    // Immortal strings have no index.
+    std::unordered_map<String *, String::CodepointIndex> &indices = String::GetCodepointIndices();
+
+    for (auto entry = indices.begin(); entry != indices.end();) {
+        if ((entry->first->flags_ & ValueData::kMarkedFlag) == 0) {
+            entry = indices.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+
+    phase_ = Phase::Sweeping;
+    unsweptObjects_ = objects_;
+    objects_ = nullptr;
+}
+
+
+bool
+GarbageCollector::sweep(Clock::time_point deadline)
+{
+    for (std::size_t i = 1; unsweptObjects_ != nullptr; ++i) {
+        if (i % kStepLength == 0 && Clock::now() >= deadline) {
+            return false;
+        }
+
+        ValueData *valueData = unsweptObjects_;
+        unsweptObjects_ = valueData->next_;
+
+        if ((valueData->flags_ & (ValueData::kImmortalFlag | ValueData::kMarkedFlag)) != 0) {
+            valueData->flags_ &= ~ValueData::kMarkedFlag;
+            valueData->next_ = objects_;
+            objects_ = valueData;
+        } else {
+            ++freedObjectCount_;
+            freedByteCount_ += valueData->getSize();
+            valueData->release();
+        }
+    }
+
+    phase_ = Phase::Idle;
+    ++statistics_.collectionCount;
+    statistics_.objectCount += freedObjectCount_;
+    statistics_.byteCount += freedByteCount_;
+    return true;
+}
+
+
+void
+GarbageCollector::MarkingBarrier(const Value &value)
+{
+    GarbageCollector *garbageCollector = Get();
+
+    if (garbageCollector->phase_ == Phase::Marking && value.hasValueData()) {
+        garbageCollector->shade(value.getValueData());
+    }
+}
+#endif // defined(KARINA_MARK_SWEEP)
+
+
+#if defined(KARINA_NURSERY)
+ValueData *
+GarbageCollector::Promote(ValueData *valueData)
+{
+    assert(IsYoung(valueData));
+
+    if ((valueData->flags_ & ValueData::kForwardedFlag) != 0) {
+        return valueData->next_;
+    }
+
+    GarbageCollector *garbageCollector = Get();
+    std::size_t size = valueData->getSize();
+    auto oldValueData = static_cast<ValueData *>(std::memcpy(Pool::Allocate(size), valueData, size));
+    oldValueData->next_ = garbageCollector->objects_;
+    garbageCollector->objects_ = oldValueData;
+    garbageCollector->allocatedSize_ += size;
+    ++garbageCollector->statistics_.promotedObjectCount;
+    garbageCollector->statistics_.promotedByteCount += size;
+    valueData->flags_ |= ValueData::kForwardedFlag;
+    valueData->next_ = oldValueData;
+
+    if (garbageCollector->phase_ == Phase::Marking) {
+        garbageCollector->shade(oldValueData);
+    }
+
+    // Its elements are still young, the remembered set doubles as the scan
+    // queue of the copy.
+    if (oldValueData->type_ == ValueData::Type::Array
+        || (oldValueData->flags_ & (ValueData::kConcatenationFlag | ValueData::kSliceFlag)) != 0) {
+        Remember(oldValueData);
+    }
+
+    return oldValueData;
+}
+
+
+void
+GarbageCollector::Remember(ValueData *valueData)
+{
+    if ((valueData->flags_ & ValueData::kRememberedFlag) == 0) {
+        valueData->flags_ |= ValueData::kRememberedFlag;
+        Get()->rememberedSet_.push_back(valueData);
+    }
+}
+
+
+void
+GarbageCollector::WriteBarrier(ValueData *valueData, const Value &value)
+{
+    if (value.hasValueData() && IsYoung(value.getValueData()) && !IsYoung(valueData)) {
+        Remember(valueData);
+    }
+}
+
+
+void
+GarbageCollector::collectYoung()
+{
+    auto promote = [] (Value *value) -> void {
+        if (value->hasValueData() && IsYoung(value->getValueData())) {
+            value->setValueData(Promote(value->getValueData()));
+        }
+    };
+
+    for (const std::pair<Value *, std::size_t> &root : roots_) {
+        for (std::size_t i = 0; i < root.second; ++i) {
+            promote(&root.first[i]);
+        }
+    }
+
+    // Grows as arrays and concatenations get promoted.
+    for (std::size_t i = 0; i < rememberedSet_.size(); ++i) {
+        ValueData *valueData = rememberedSet_[i];
+        valueData->flags_ &= ~ValueData::kRememberedFlag;
+
+        if (valueData->type_ == ValueData::Type::Array) {
+            Array *array = static_cast<Array *>(valueData);
+            Value *elements = array->getElements();
+
+            for (std::size_t j = 0; j < array->getLength(); ++j) {
+                promote(&elements[j]);
+            }
+        } else if ((valueData->flags_ & ValueData::kConcatenationFlag) != 0) {
+            String::Concatenation *concatenation = static_cast<String *>(valueData)->getConcatenation();
+            promote(&concatenation->left);
+            promote(&concatenation->right);
+        } else {
+            promote(&static_cast<String *>(valueData)->getSlice()->parent);
+        }
+    }
+
+    rememberedSet_.clear();
+
+    // Weak references to what was not promoted are cleared, the rest are
+    // pointed to the old copies.
+    std::unordered_map<ValueData *, WeakReference *> &table = WeakReference::GetTable();
+    std::unordered_map<ValueData *, WeakReference *> oldTable;
+
+    auto getOld = [] (ValueData *valueData) -> ValueData * {
+        if (!IsYoung(valueData)) {
+            return valueData;
+        } else if ((valueData->flags_ & ValueData::kForwardedFlag) != 0) {
+            return valueData->next_;
+        } else {
+            return nullptr;
+        }
+    };
+
+    for (const std::pair<ValueData *const, WeakReference *> &entry : table) {
+        ValueData *valueData = getOld(entry.first);
+        auto weakReference = static_cast<WeakReference *>(getOld(entry.second));
+
+        if (weakReference == nullptr) {
+            if (valueData != nullptr) {
+                valueData->flags_ &= ~ValueData::kWeaklyReferencedFlag;
+            }
+        } else if (valueData == nullptr) {
+            new (&weakReference->value_) Value();
+        } else {
+            weakReference->value_.setValueData(valueData);
+            oldTable.emplace(valueData, weakReference);
+        }
+    }
+
+    table.swap(oldTable);
+    // Interned strings that were not promoted are dropped, the rest are
+    // pointed to the old copies.
+    std::unordered_multimap<std::size_t, String *> &strings = String::GetTable();
+
+    for (auto entry = strings.begin(); entry != strings.end();) {
+        auto string = static_cast<String *>(getOld(entry->second));
+
+        if (string == nullptr) {
+            entry = strings.erase(entry);
+        } else {
+            entry->second = string;
+            ++entry;
+        }
+    }
+
+    // Likewise for codepoint indices.
+    std::unordered_map<String *, String::CodepointIndex> &indices = String::GetCodepointIndices();
+    std::unordered_map<String *, String::CodepointIndex> oldIndices;
+
+    for (std::pair<String *const, String::CodepointIndex> &entry : indices) {
+        if (auto string = static_cast<String *>(getOld(entry.first))) {
+            oldIndices.emplace(string, std::move(entry.second));
+        }
+    }
+
+    indices.swap(oldIndices);
+
+#   if defined(KARINA_HEAP_STATISTICS) || defined(KARINA_MEMORY_QUOTA)
+    // Whatever was not promoted is dead, promoted objects stay charged.
+    for (char *object = nursery_; object < nurseryTop_;) {
+        auto valueData = reinterpret_cast<ValueData *>(object);
+        object += (valueData->getSize() + 7) & ~static_cast<std::size_t>(7);
+
+        if ((valueData->flags_ & ValueData::kForwardedFlag) == 0) {
+#       if defined(KARINA_HEAP_STATISTICS)
+            Heap::NotifyReleased(valueData);
+#       endif
+#       if defined(KARINA_MEMORY_QUOTA)
+            MemoryQuota::Credit(valueData->getSize());
+#       endif
+        }
+    }
+#   endif
+    nurseryTop_ = nursery_;
+    isNurseryFull_ = false;
+    ++statistics_.youngCollectionCount;
+}
+#endif // defined(KARINA_NURSERY)
+
+
+String *
+String::New(const char *characters, std::size_t length)
+{
+    String *string = ::new (Allocate(sizeof(String) + length)) String(length);
+    std::memcpy(string->getCharacters(), characters, length);
+    return string;
+}
+
+
+void
+String::Delete(String *string)
+{
+    std::size_t size = string->getSize();
+
+    if (string->isConcatenation()) {
+        string->getConcatenation()->~Concatenation();
+    } else if (string->isSlice()) {
+        string->getSlice()->~Slice();
+    }
+
+    string->~String();
+#if defined(KARINA_MEMORY_QUOTA)
+    MemoryQuota::Credit(size);
+#endif
+    Pool::Free(string, size);
+}
+
+
+std::size_t
+String::Hash(const char *characters, std::size_t length)
+{
+    // wyhash, final version 3, reading words in native order.
+    static const std::uint64_t secret[4] = {
+        UINT64_C(0xA0761D6478BD642F), UINT64_C(0xE7037ED1A0B428DB),
+        UINT64_C(0x8EBC6AF09C88C6E3), UINT64_C(0x589965CC75374CC3),
+    };
+
+    auto mix = [] (std::uint64_t a, std::uint64_t b) -> std::uint64_t {
+        Multiply(&a, &b);
+        return a ^ b;
+    };
+
+    auto read64 = [] (const char *bytes) -> std::uint64_t {
+        std::uint64_t word;
+        std::memcpy(&word, bytes, 8);
+        return word;
+    };
+
+    auto read32 = [] (const char *bytes) -> std::uint64_t {
+        std::uint32_t word;
+        std::memcpy(&word, bytes, 4);
+        return word;
+    };
+
+    // Per process, lest keys be crafted to collide.
+    static const std::uint64_t seed = [] () -> std::uint64_t {
+        std::random_device randomDevice;
+        auto time = static_cast<std::uint64_t>(
+            std::chrono::steady_clock::now().time_since_epoch().count());
+        return (static_cast<std::uint64_t>(randomDevice()) << 32 ^ randomDevice() ^ time)
+               ^ secret[0];
+    }();
+
+    std::uint64_t hash = seed;
+    std::uint64_t a;
+    std::uint64_t b;
+
+    if (length <= 16) {
+        // Most keys: a few overlapping reads, which cover the whole key.
+        if (length >= 4) {
+            std::size_t offset = (length >> 3) << 2;
+            a = read32(characters) << 32 | read32(characters + offset);
+            b = read32(characters + length - 4) << 32 | read32(characters + length - 4 - offset);
+        } else if (length >= 1) {
+            auto bytes = reinterpret_cast<const unsigned char *>(characters);
+            a = static_cast<std::uint64_t>(bytes[0]) << 16
+                | static_cast<std::uint64_t>(bytes[length >> 1]) << 8 | bytes[length - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        const char *bytes = characters;
+        std::size_t rest = length;
+
+        if (rest > 48) {
+            std::uint64_t hash1 = hash;
+            std::uint64_t hash2 = hash;
+
+            do {
+                hash = mix(read64(bytes) ^ secret[1], read64(bytes + 8) ^ hash);
+                hash1 = mix(read64(bytes + 16) ^ secret[2], read64(bytes + 24) ^ hash1);
+                hash2 = mix(read64(bytes + 32) ^ secret[3], read64(bytes + 40) ^ hash2);
+                bytes += 48;
+                rest -= 48;
+            } while (rest > 48);
+
+            hash ^= hash1 ^ hash2;
+        }
+
+        for (; rest > 16; bytes += 16, rest -= 16) {
+            hash = mix(read64(bytes) ^ secret[1], read64(bytes + 8) ^ hash);
+        }
+
+        a = read64(bytes + rest - 16);
+        b = read64(bytes + rest - 8);
+    }
+
+    return static_cast<std::size_t>(mix(secret[1] ^ length, mix(a ^ secret[1], b ^ hash)));
+}
+
+
+void
+String::Multiply(std::uint64_t *a, std::uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 Product;
+    Product product = static_cast<Product>(*a) * *b;
+    *a = static_cast<std::uint64_t>(product);
+    *b = static_cast<std::uint64_t>(product >> 64);
+#else
+    std::uint64_t high = (*a >> 32) * (*b >> 32);
+    std::uint64_t middle1 = (*a >> 32) * (*b & 0xFFFFFFFF);
+    std::uint64_t middle2 = (*a & 0xFFFFFFFF) * (*b >> 32);
+    std::uint64_t low = (*a & 0xFFFFFFFF) * (*b & 0xFFFFFFFF);
+    std::uint64_t carry = middle1 + (low >> 32);
+    std::uint64_t middle = (carry & 0xFFFFFFFF) + middle2;
+    *a = middle << 32 | (low & 0xFFFFFFFF);
+    *b = high + (carry >> 32) + (middle >> 32);
+#endif
+}
+
+
+std::unordered_multimap<std::size_t, String *> &
+String::GetTable()
+{
+    static thread_local std::unordered_multimap<std::size_t, String *> table;
+    return table;
+}
+
+
+String *
+String::Intern(const char *characters, std::size_t length)
+{
+    std::unordered_multimap<std::size_t, String *> &table = GetTable();
+    std::size_t hash = Hash(characters, length);
+    auto entries = table.equal_range(hash);
+
+    for (auto entry = entries.first; entry != entries.second; ++entry) {
+        String *string = entry->second;
+
+        if (string->length_ == length
+            && std::memcmp(string->getCharacters(), characters, length) == 0) {
+            return static_cast<String *>(string->copy());
+        }
+    }
+
+    String *string;
+    {
+#if defined(KARINA_ARENA_SCOPES)
+        // Made on the heap, as the table has to outlive any arena.
+        ArenaScope::Bypass bypass;
+#endif
+        string = New(characters, length);
+    }
+
+    string->hash_ = hash;
+    table.emplace(hash, string);
+    string->flags_ |= kInternedFlag;
+    return string;
+}
+
+
+void
+String::Unintern(String *string)
+{
+    std::unordered_multimap<std::size_t, String *> &table = GetTable();
+    auto entries = table.equal_range(string->hash_);
+    auto entry = entries.first;
+
+    while (entry != entries.second && entry->second != string) {
+        ++entry;
+    }
+
+    // Strings nested in shared objects are uninterned along with them, so
+    // it is never in the table of another thread.
+    assert(entry != entries.second);
+    table.erase(entry);
+    string->flags_ &= ~kInternedFlag;
+}
+
+
+std::unordered_map<String *, String::CodepointIndex> &
+String::GetCodepointIndices()
+{
+    static thread_local std::unordered_map<String *, CodepointIndex> codepointIndices;
+    return codepointIndices;
+}
+
+
+void
+String::Unindex(String *string)
+{
+    GetCodepointIndices().erase(string);
+    string->flags_ &= ~kIndexedFlag;
+}
+
+
+String *
+String::Concatenate(String *left, String *right)
+{
+    left = left->resolve();
+    right = right->resolve();
+    assert(left->length_ + right->length_ >= kMinConcatenationLength);
+
+    if (std::max(left->getDepth(), right->getDepth()) < kMaxConcatenationDepth) {
+        return Join(Value(static_cast<String *>(left->copy())),
+                    Value(static_cast<String *>(right->copy())));
+    }
+
+    // The pieces of both, in order.
+    std::vector<String *> pieces;
+    String *stack[kMaxConcatenationDepth + 2];
+    std::size_t stackSize = 0;
+    stack[stackSize++] = right;
+    stack[stackSize++] = left;
+
+    while (stackSize >= 1) {
+        String *string = stack[--stackSize]->resolve();
+
+        if (string->isConcatenation()) {
+            Concatenation *concatenation = string->getConcatenation();
+            stack[stackSize++] = concatenation->right.getString();
+            stack[stackSize++] = concatenation->left.getString();
+        } else {
+            pieces.push_back(string);
+        }
+    }
+
+    std::vector<Value> leaves;
+
+    for (std::size_t i = 0; i < pieces.size();) {
+        std::size_t length = pieces[i]->length_;
+        std::size_t j = i + 1;
+
+        while (j < pieces.size() && length + pieces[j]->length_ <= kMaxMergedLength) {
+            length += pieces[j++]->length_;
+        }
+
+        if (j == i + 1) {
+            leaves.push_back(Value(static_cast<String *>(pieces[i]->copy())));
+        } else {
+            String *leaf = ::new (Allocate(sizeof(String) + length)) String(length);
+            char *characters = leaf->getCharacters();
+
+            for (std::size_t k = i; k < j; ++k) {
+                std::memcpy(characters, pieces[k]->getCharacters(), pieces[k]->length_);
+                characters += pieces[k]->length_;
+            }
+
+            leaves.push_back(Value(leaf));
+        }
+
+        i = j;
+    }
+
+    Value string = Balance(leaves.data(), leaves.size());
+    return static_cast<String *>(string.getString()->copy());
+}
+
+
+String *
+String::Join(Value &&left, Value &&right)
+{
+    std::size_t length = left.getString()->length_ + right.getString()->length_;
+    std::size_t depth = std::max(left.getString()->getDepth(), right.getString()->getDepth()) + 1;
+    String *string = ::new (Allocate(sizeof(String) + sizeof(Concatenation)))
+                     String(length, std::move(left), std::move(right), depth);
+#if defined(KARINA_NURSERY)
+    // Too large for the nursery, but its halves may be young.
+    if (!GarbageCollector::IsYoung(string)) {
+        GarbageCollector::Remember(string);
+    }
+#endif
+    return string;
+}
+
+
+Value
+String::Balance(Value *leaves, std::size_t count)
+{
+    if (count == 1) {
+        return leaves[0];
+    } else {
+        std::size_t halfCount = count / 2;
+        return Value(Join(Balance(leaves, halfCount),
+                          Balance(leaves + halfCount, count - halfCount)));
+    }
+}
+
+
+String *
+String::Substring(String *string, std::size_t offset, std::size_t length)
+{
+    // Slices are of flat strings only.
+    string->getCharacters();
+    string = string->resolve();
+
+    if (string->isSlice()) {
+        offset += string->getSlice()->offset;
+        string = string->getSlice()->parent.getString();
+    }
+
+    String *slice = ::new (Allocate(sizeof(String) + sizeof(Slice)))
+                    String(length, Value(static_cast<String *>(string->copy())), offset);
+#if defined(KARINA_NURSERY)
+    // Too large for the nursery, but its parent may be young.
+    if (!GarbageCollector::IsYoung(slice)) {
+        GarbageCollector::Remember(slice);
+    }
+#endif
+    return slice;
+}
+
+
+String::String(std::size_t length)
+  : ValueData(Type::String),
+    length_(length),
+    hash_(0)
+{
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyMade(this);
+#endif
+}
+
+
+String::String(std::size_t length, Value &&left, Value &&right, std::size_t depth)
+  : ValueData(Type::String),
+    length_(length),
+    hash_(0)
+{
+    flags_ |= kConcatenationFlag;
+    new (getConcatenation()) Concatenation{std::move(left), std::move(right), depth};
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyMade(this);
+#endif
+}
+
+
+String::String(std::size_t length, Value &&parent, std::size_t offset)
+  : ValueData(Type::String),
+    length_(length),
+    hash_(0)
+{
+    flags_ |= kSliceFlag;
+    new (getSlice()) Slice{std::move(parent), offset};
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyMade(this);
+#endif
+}
+
+
+constexpr
+String::String(std::size_t length, Encoding encoding, ImmortalTag immortalTag)
+  : ValueData(Type::String, immortalTag),
+    length_(length),
+    hash_(0)
+{
+    flags_ |= kClassifiedFlag;
+
+    if (encoding != Encoding::Binary) {
+        flags_ |= kUtf8Flag;
+    }
+
+    if (encoding == Encoding::Ascii) {
+        flags_ |= kAsciiFlag;
+    }
+}
+
+
+char *
+String::getCharacters()
+{
+    if ((flags_ & (kConcatenationFlag | kSliceFlag)) == 0) {
+        return reinterpret_cast<char *>(this + 1);
+    } else if (isSlice()) {
+        Slice *slice = getSlice();
+        return slice->parent.getString()->getCharacters() + slice->offset;
+    } else {
+        Concatenation *concatenation = getConcatenation();
+
+        if (!concatenation->right.isNull()) {
+            flatten();
+        }
+
+        return concatenation->left.getString()->getCharacters();
+    }
+}
+
+
+std::size_t
+String::getLength() const
+{
+    return length_;
+}
+
+
+std::size_t
+String::getSize() const
+{
+    if (isConcatenation()) {
+        return sizeof(String) + sizeof(Concatenation);
+    } else if (isSlice()) {
+        return sizeof(String) + sizeof(Slice);
+    } else {
+        return sizeof(String) + length_;
+    }
+}
+
+
+bool
+String::isConcatenation() const
+{
+    return (flags_ & kConcatenationFlag) != 0;
+}
+
+
+bool
+String::isSlice() const
+{
+    return (flags_ & kSliceFlag) != 0;
+}
+
+
+std::size_t
+String::getHash()
+{
+    if (hash_ != 0) {
+        return hash_;
+    }
+
+    std::size_t hash = Hash(getCharacters(), length_);
+
+    // Immortal strings may be in read-only memory.
+    if ((flags_ & kImmortalFlag) == 0) {
+        hash_ = hash;
+    }
+
+    return hash;
+}
+
+
+bool
+String::isInterned() const
+{
+    return (flags_ & kInternedFlag) != 0;
+}
+
+
+String::Concatenation *
+String::getConcatenation()
+{
+    assert(isConcatenation());
+    return reinterpret_cast<Concatenation *>(this + 1);
+}
+
+
+String *
+String::resolve()
+{
+    if (isConcatenation() && getConcatenation()->right.isNull()) {
+        return getConcatenation()->left.getString();
+    } else {
+        return this;
+    }
+}
+
+
+std::size_t
+String::getDepth()
+{
+    if (isConcatenation()) {
+        return getConcatenation()->depth;
+    } else {
+        return 0;
+    }
+}
+
+
+void
+String::flatten()
+{
+    String *string;
+    {
+#if defined(KARINA_ARENA_SCOPES)
+        // Made on the heap, as the concatenation may be there.
+        ArenaScope::Bypass bypass;
+#endif
+        string = ::new (Allocate(sizeof(String) + length_)) String(length_);
+    }
+
+    char *characters = string->getCharacters();
+    String *stack[kMaxConcatenationDepth + 2];
+    std::size_t stackSize = 0;
+    stack[stackSize++] = this;
+
+    while (stackSize >= 1) {
+        String *piece = stack[--stackSize];
+
+        if (piece->isConcatenation() && !piece->getConcatenation()->right.isNull()) {
+            stack[stackSize++] = piece->getConcatenation()->right.getString();
+            stack[stackSize++] = piece->getConcatenation()->left.getString();
+        } else {
+            std::memcpy(characters, piece->getCharacters(), piece->length_);
+            characters += piece->length_;
+        }
+    }
+
+    Concatenation *concatenation = getConcatenation();
+    Value left(string);
+#if defined(KARINA_NURSERY)
+    GarbageCollector::WriteBarrier(this, left);
+#endif
+    concatenation->left = std::move(left);
+    concatenation->right = Value();
+    concatenation->depth = 1;
+}
+
+
+String::Slice *
+String::getSlice()
+{
+    assert(isSlice());
+    return reinterpret_cast<Slice *>(this + 1);
+}
+
+
+void
+String::compact()
+{
+    String *string;
+    {
+#if defined(KARINA_ARENA_SCOPES)
+        // Made on the heap, as the slice may be there.
+        ArenaScope::Bypass bypass;
+#endif
+        string = New(getCharacters(), length_);
+    }
+
+    Slice *slice = getSlice();
+    Value parent(string);
+#if defined(KARINA_NURSERY)
+    GarbageCollector::WriteBarrier(this, parent);
+#endif
+    slice->parent = std::move(parent);
+    slice->offset = 0;
+}
+
+
+bool
+String::equals(String *other)
+{
+    if (other == this) {
+        return true;
+    } else if (isInterned() && other->isInterned()) {
+        return false;
+    } else {
+        return other->length_ == length_
+               && std::memcmp(other->getCharacters(), getCharacters(), length_) == 0;
+    }
+}
+
+
+bool
+String::isUtf8()
+{
+    return (classify() & kUtf8Flag) != 0;
+}
+
+
+bool
+String::isAscii()
+{
+    return (classify() & kAsciiFlag) != 0;
+}
+
+
+std::size_t
+String::getCodepointCount()
+{
+    assert(isUtf8());
+
+    if (isAscii()) {
+        return length_;
+    } else if (CodepointIndex *index = getCodepointIndex()) {
+        return index->codepointCount;
+    } else {
+        return Utf8::CountCodepoints(getCharacters(), length_);
+    }
+}
+
+
+std::size_t
+String::getCodepointOffset(std::size_t index)
+{
+    assert(isUtf8());
+
+    if (isAscii()) {
+        assert(index <= length_);
+        return index;
+    } else if (CodepointIndex *codepointIndex = getCodepointIndex()) {
+        assert(index <= codepointIndex->codepointCount);
+        return Utf8::Skip(getCharacters(), codepointIndex->offsets[index / kCodepointIndexStride],
+                          index % kCodepointIndexStride);
+    } else {
+        return Utf8::Skip(getCharacters(), 0, index);
+    }
+}
+
+
+unsigned short
+String::classify()
+{
+    if ((flags_ & kClassifiedFlag) != 0) {
+        return flags_;
+    }
+
+    unsigned short flags = kClassifiedFlag;
+
+    switch (Utf8::Classify(getCharacters(), length_)) {
+    case Encoding::Ascii:
+        flags |= kAsciiFlag | kUtf8Flag;
+        break;
+
+    case Encoding::Utf8:
+        flags |= kUtf8Flag;
+        break;
+
+    case Encoding::Binary:
+        break;
+    }
+
+    // Immortal strings may be in read-only memory.
+    if ((flags_ & kImmortalFlag) == 0) {
+        flags_ |= flags;
+    }
+
+    return flags;
+}
+
+
+String::CodepointIndex *
+String::getCodepointIndex()
+{
+    if (length_ < kMinIndexedLength || (flags_ & (kImmortalFlag | kSharedFlag)) != 0) {
+        return nullptr;
+    }
+
+    auto entry = GetCodepointIndices().emplace(this, CodepointIndex());
+    CodepointIndex *index = &entry.first->second;
+
+    if (entry.second) {
+        const char *characters = getCharacters();
+        index->codepointCount = Utf8::CountCodepoints(characters, length_);
+        index->offsets.reserve(index->codepointCount / kCodepointIndexStride + 1);
+        index->offsets.push_back(0);
+
+        for (std::size_t i = kCodepointIndexStride; i <= index->codepointCount;
+             i += kCodepointIndexStride) {
+            index->offsets.push_back(Utf8::Skip(characters, index->offsets.back(),
+                                                kCodepointIndexStride));
+        }
+
+        flags_ |= kIndexedFlag;
+    }
+
+    return index;
+}
+
+
+template<std::size_t N>
+constexpr
+StaticString<N>::StaticString(const char (&characters)[N + 1])
+  : StaticString(characters, std::make_index_sequence<N + 1>())
+{
+}
+
+
+template<std::size_t N>
+template<std::size_t... I>
+constexpr
+StaticString<N>::StaticString(const char (&characters)[N + 1], std::index_sequence<I...>)
+  : string_(N, Utf8::ClassifyConstant(characters, N), ImmortalTag()),
+    characters_{characters[I]...}
+{
+}
+
+
+template<std::size_t N>
+Value
+StaticString<N>::get() const
+{
+    if (N <= Value::kShortStringCapacity) {
+        return Value(characters_, N);
+    } else {
+        return Value(const_cast<String *>(&string_));
+    }
+}
+
+
+Array::Array(std::size_t length)
+  : ValueData(Type::Array),
+    length_(length)
+{
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyMade(this);
+#endif
+}
+
+
+constexpr
+Array::Array(std::size_t length, ImmortalTag immortalTag)
+  : ValueData(Type::Array, immortalTag),
+    length_(length)
+{
+}
+
+
+Array *
+Array::New()
+{
+    static constexpr Array emptyArray(0, ImmortalTag());
+    return const_cast<Array *>(&emptyArray);
+}
+
+
+template<class... Args>
+Array *
+Array::New(Args &&... args)
+{
+    std::size_t length = sizeof...(Args);
+    Array *array = ::new (Allocate(sizeof(Array) + length * sizeof(Value))) Array(length);
+    Value *element = array->getElements();
+    int dummy[] = {0, (new (element++) Value(std::forward<Args>(args)), 0)...};
+    static_cast<void>(dummy);
+    static_cast<void>(element);
+#if defined(KARINA_NURSERY)
+    // Too large for the nursery, but its elements may be young.
+    if (!GarbageCollector::IsYoung(array)) {
+        GarbageCollector::Remember(array);
+    }
+#endif
+    return array;
+}
+
+
+Array *
+Array::NewOfLength(std::size_t length)
+{
+    Array *array = ::new (Allocate(sizeof(Array) + length * sizeof(Value))) Array(length);
+    Value *elements = array->getElements();
+
+    for (std::size_t i = 0; i < length; ++i) {
+        new (&elements[i]) Value();
+    }
+
+    return array;
+}
+
+
+void
+Array::Delete(Array *array)
+{
+    Value *elements = array->getElements();
+
+    for (std::size_t i = 0; i < array->length_; ++i) {
+        elements[i].~Value();
+    }
+
+    Deallocate(array);
+}
+
+
+void
+Array::Deallocate(Array *array)
+{
+    std::size_t size = array->getSize();
+    array->~Array();
+#if defined(KARINA_MEMORY_QUOTA)
+    MemoryQuota::Credit(size);
+#endif
+    Pool::Free(array, size);
+}
+
+
+Value *
+Array::getElements()
+{
+    return reinterpret_cast<Value *>(this + 1);
+}
+
+
+void
+Array::setElement(std::size_t index, const Value &value)
+{
+    assert(index < length_);
+#if defined(KARINA_NURSERY)
+    GarbageCollector::WriteBarrier(this, value);
+#endif
+    getElements()[index] = value;
+}
+
+
+std::size_t
+Array::getLength() const
+{
+    return length_;
+}
+
+
+std::size_t
+Array::getSize() const
+{
+    return sizeof(Array) + length_ * sizeof(Value);
+}
+
+
+Dictionary::Dictionary()
+  : ValueData(Type::Dictionary)
+{
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyMade(this);
+#endif
+}
+
+
+Closure::Closure()
+  : ValueData(Type::Closure)
+{
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyMade(this);
+#endif
+}
+
+
+WeakReference::WeakReference(const Value &value)
+  : ValueData(Type::WeakReference)
+{
+    std::memcpy(static_cast<void *>(&value_), &value, sizeof value_);
+#if defined(KARINA_HEAP_STATISTICS)
+    Heap::NotifyMade(this);
+#endif
+}
+
+
+#define VALUE_DATA_DESTRUCTOR(valueDataType) \
+    valueDataType::~valueDataType()         \
+    {                                       \
+    }
+
+VALUE_DATA_DESTRUCTOR(Dictionary)
+VALUE_DATA_DESTRUCTOR(Closure)
+
+#undef VALUE_DATA_DESTRUCTOR
+
+
+WeakReference::~WeakReference()
+{
+    if (value_.hasValueData()) {
+        ValueData *valueData = value_.getValueData();
+
+        if ((valueData->flags_ & kWeaklyReferencedFlag) != 0) {
+            valueData->flags_ &= ~kWeaklyReferencedFlag;
+            GetTable().erase(valueData);
+        }
+
+        // Not counted, so not to be destroyed.
+        new (&value_) Value();
+    }
+}
+
+
+Value
+WeakReference::get() const
+{
+#if defined(KARINA_INCREMENTAL_MARKING)
+    // The object may be what marking has yet to reach.
+    GarbageCollector::MarkingBarrier(value_);
+#endif
+    return value_;
+}
+
+
+bool
+WeakReference::isCleared() const
+{
+    return value_.isNull();
+}
+
+
+std::unordered_map<ValueData *, WeakReference *> &
+WeakReference::GetTable()
+{
+    static thread_local std::unordered_map<ValueData *, WeakReference *> table;
+    return table;
+}
+
+
+WeakReference *
+WeakReference::Make(const Value &value)
+{
+#if defined(KARINA_ARENA_SCOPES)
+    // Made on the heap, as the table has to outlive any arena.
+    ArenaScope::Bypass bypass;
+#endif
+    WeakReference *weakReference;
+
+    if (!value.hasValueData()
+        || (value.getValueData()->flags_ & kImmortalFlag) != 0) {
+        weakReference = new WeakReference(value);
+    } else if ((value.getValueData()->flags_ & kSharedFlag) != 0) {
+        weakReference = new WeakReference(Value());
+    } else {
+        ValueData *valueData = value.getValueData();
+        std::unordered_map<ValueData *, WeakReference *> &table = GetTable();
+        auto entry = table.find(valueData);
+
+        if (entry != table.end()) {
+            weakReference = static_cast<WeakReference *>(entry->second->copy());
+        } else {
+            weakReference = new WeakReference(value);
+            table.emplace(valueData, weakReference);
+            valueData->flags_ |= kWeaklyReferencedFlag;
+        }
+    }
+
+    return weakReference;
+}
+
+
+void
+WeakReference::Clear(ValueData *valueData)
+{
+    std::unordered_map<ValueData *, WeakReference *> &table = GetTable();
+    auto entry = table.find(valueData);
+    assert(entry != table.end());
+    new (&entry->second->value_) Value();
+    valueData->flags_ &= ~kWeaklyReferencedFlag;
+    table.erase(entry);
+}
+
+
+void
+WeakReference::detach()
+{
+    if (value_.hasValueData() && (value_.getValueData()->flags_ & kImmortalFlag) == 0) {
+        Clear(value_.getValueData());
+    }
 }
 
 } // namespace Karina
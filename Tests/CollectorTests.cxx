@@ -0,0 +1,434 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Test.hxx"
+
+
+namespace {
+
+using namespace Karina;
+
+
+KARINA_TEST(RootedValuesSurviveCollections)
+{
+    Test::Roots<1> roots;
+    GarbageCollector::SetThreshold(1 << 10);
+
+    for (std::size_t i = 0; i < 1000; ++i) {
+        std::string characters = "element number " + std::to_string(i) + " of the chain";
+        roots[0] = Value::MakeArray(Value::MakeString(characters.data(), characters.size()),
+                                    roots[0]);
+        GarbageCollector::Poll();
+    }
+
+    // Copied, as the constant is not defined out of the class.
+    std::size_t threshold = GarbageCollector::kDefaultThreshold;
+    GarbageCollector::SetThreshold(threshold);
+    Test::Reclaim();
+    Value *link = &roots[0];
+
+    for (std::size_t i = 1000; i-- > 0;) {
+        std::string characters = "element number " + std::to_string(i) + " of the chain";
+        Value *elements = link->getArray()->getElements();
+        String *string = elements[0].getString();
+        KARINA_CHECK(std::string(string->getCharacters(), string->getLength()) == characters);
+        link = &elements[1];
+    }
+
+    KARINA_CHECK(link->isNull());
+}
+
+
+KARINA_TEST(ElementsMovedWhileMarkingSurvive)
+{
+    Test::Roots<2> roots;
+    std::string expected[8];
+    roots[0] = Value::MakeArray(Value(), Value(), Value(), Value(), Value(), Value(), Value(),
+                                Value());
+    GarbageCollector::SetThreshold(1 << 10);
+    GarbageCollector::SetPauseBudget(std::chrono::microseconds(1));
+
+    for (std::size_t i = 0; i < 20000; ++i) {
+        std::size_t j = i % 8;
+        std::size_t k = i * 5 % 8;
+        // Taken out of the array and put back elsewhere, while the array may
+        // have been scanned already.
+        roots[1] = roots[0].getArray()->getElements()[j];
+        std::string characters = "string number " + std::to_string(i) + ", made while marking";
+        roots[0].getArray()->setElement(j, Value::MakeString(characters.data(),
+                                                             characters.size()));
+        GarbageCollector::Poll();
+        roots[0].getArray()->setElement(k, roots[1]);
+        roots[1] = Value();
+        std::string moved = expected[j];
+        expected[j] = characters;
+        expected[k] = moved;
+    }
+
+    // Copied, as the constants are not defined out of the class.
+    std::size_t threshold = GarbageCollector::kDefaultThreshold;
+    std::chrono::microseconds::rep pauseBudget = GarbageCollector::kDefaultPauseBudget;
+    GarbageCollector::SetThreshold(threshold);
+    GarbageCollector::SetPauseBudget(std::chrono::microseconds(pauseBudget));
+    Test::Reclaim();
+
+    for (std::size_t j = 0; j < 8; ++j) {
+        Value &element = roots[0].getArray()->getElements()[j];
+        KARINA_CHECK(element.isNull() == expected[j].empty());
+
+        if (!element.isNull()) {
+            String *string = element.getString();
+            KARINA_CHECK(std::string(string->getCharacters(), string->getLength()) == expected[j]);
+        }
+    }
+}
+
+
+// Strings and arrays never change once made, so what a value describes to
+// must not change either, down to that depth.
+std::string
+Describe(Value &value, int depth)
+{
+    if (value.isNull()) {
+        return "null";
+    } else if (value.isInteger()) {
+        return std::to_string(static_cast<unsigned long>(*value.getInteger()));
+    } else if (value.isString()) {
+        std::size_t length;
+        char *characters = value.getStringCharacters(&length);
+        return '"' + std::string(characters, length) + '"';
+    } else if (value.isWeakReference()) {
+        return "weak";
+    } else if (value.isArray()) {
+        if (depth == 0) {
+            return "[...]";
+        }
+
+        Array *array = value.getArray();
+        std::string description = "[";
+
+        for (std::size_t i = 0; i < array->getLength(); ++i) {
+            description += Describe(array->getElements()[i], depth - 1) + ",";
+        }
+
+        return description + "]";
+    } else {
+        return "?";
+    }
+}
+
+
+// Returns true if both hold the same object, or are alike if neither holds
+// any.
+bool
+IsSame(Value &value, Value &other)
+{
+    if (value.isArray() && other.isArray()) {
+        return value.getArray() == other.getArray();
+    } else if (value.isWeakReference() && other.isWeakReference()) {
+        return value.getWeakReference() == other.getWeakReference();
+    } else if (value.isString() && other.isString()
+               && (value.getString() != nullptr || other.getString() != nullptr)) {
+        return value.getString() == other.getString();
+    } else {
+        return Describe(value, 0) == Describe(other, 0);
+    }
+}
+
+
+KARINA_TEST(RandomRootMutationsKeepEverythingIntact)
+{
+    // Enough for sweeping to take several polls.
+    static constexpr std::size_t kRootCount = 256;
+    static constexpr int kDepth = 3;
+    static const char *const kIdentifiers[] = {
+        "first_identifier",
+        "second_identifier",
+        "third_identifier",
+        "fourth_identifier",
+    };
+
+    std::mt19937 random(20161016);
+    Test::Roots<kRootCount> roots;
+    // What every root describes to, and how many times it has been stored
+    // to. Weak references remember the root their object came from, which
+    // must still be their object for as long as that root is not stored to.
+    std::string descriptions[kRootCount];
+    std::size_t generations[kRootCount] = {};
+    std::string targetDescriptions[kRootCount];
+    std::size_t targetRoots[kRootCount] = {};
+    std::size_t targetGenerations[kRootCount] = {};
+    GarbageCollector::SetThreshold(1 << 12);
+    GarbageCollector::SetPauseBudget(std::chrono::microseconds(1));
+
+    for (std::size_t i = 0; i < kRootCount; ++i) {
+        descriptions[i] = Describe(roots[i], kDepth);
+    }
+
+    for (std::size_t iteration = 0; iteration < 100000; ++iteration) {
+        std::size_t a = random() % kRootCount;
+        std::size_t b = random() % kRootCount;
+        std::size_t c = random() % kRootCount;
+        // The root stored to.
+        std::size_t stored = a;
+
+        switch (random() % 9) {
+        case 0: {
+            std::string characters(16 + random() % 48, static_cast<char>('a' + random() % 26));
+            characters += std::to_string(iteration);
+            roots[a] = Value::MakeString(characters.data(), characters.size());
+            break;
+        }
+
+        case 1: {
+            const char *identifier = kIdentifiers[random() % 4];
+            roots[a] = Value::MakeInternedString(identifier, std::strlen(identifier));
+            break;
+        }
+
+        case 2:
+            targetDescriptions[a] = descriptions[b];
+            targetRoots[a] = b;
+            targetGenerations[a] = generations[b];
+            roots[a] = Value::MakeWeakReference(roots[b]);
+            break;
+
+        case 3:
+            stored = b;
+
+            if (roots[a].isWeakReference()) {
+                Value value = roots[a].getWeakReference()->get();
+
+                // What a weak reference to a weak reference refers to is
+                // not kept track of.
+                if (!value.isNull() && !value.isWeakReference()) {
+                    roots[b] = value;
+                }
+            }
+
+            break;
+
+        case 4:
+            roots[a] = Value();
+            break;
+
+        case 5:
+            roots[a] = Value::MakeArray(roots[b], roots[c]);
+            break;
+
+        case 6:
+            if (roots[b].isString() && roots[c].isString()) {
+                roots[a] = Value::Concatenate(roots[b], roots[c]);
+            }
+
+            break;
+
+        case 7:
+            if (roots[b].isString()) {
+                std::size_t length;
+                roots[b].getStringCharacters(&length);
+                std::size_t offset = random() % (length + 1);
+                roots[a] = Value::Substring(roots[b], offset, random() % (length - offset + 1));
+            }
+
+            break;
+
+        case 8:
+            targetDescriptions[a] = targetDescriptions[b];
+            targetRoots[a] = targetRoots[b];
+            targetGenerations[a] = targetGenerations[b];
+            roots[a] = roots[b];
+            break;
+        }
+
+        ++generations[stored];
+        descriptions[stored] = Describe(roots[stored], kDepth);
+        GarbageCollector::Poll();
+
+        for (std::size_t i = 0; i < kRootCount; ++i) {
+            if (roots[i].isWeakReference()
+                && generations[targetRoots[i]] == targetGenerations[i]) {
+                Value value = roots[i].getWeakReference()->get();
+                KARINA_CHECK(IsSame(value, roots[targetRoots[i]]));
+            }
+        }
+
+        if (iteration % 100 != 0) {
+            continue;
+        }
+
+        for (std::size_t i = 0; i < kRootCount; ++i) {
+            KARINA_CHECK(Describe(roots[i], kDepth) == descriptions[i]);
+
+            if (!roots[i].isWeakReference()) {
+                continue;
+            }
+
+            WeakReference *weakReference = roots[i].getWeakReference();
+            Value value = weakReference->get();
+            KARINA_CHECK(value.isNull() || Describe(value, kDepth) == targetDescriptions[i]);
+
+            // Objects have one weak reference at most, which must be this one.
+            if (value.isArray() || value.isWeakReference()
+                || (value.isString() && value.getString() != nullptr)) {
+                KARINA_CHECK(Value::MakeWeakReference(value).getWeakReference() == weakReference);
+            }
+        }
+    }
+
+    // Copied, as the constants are not defined out of the class.
+    std::size_t threshold = GarbageCollector::kDefaultThreshold;
+    std::chrono::microseconds::rep pauseBudget = GarbageCollector::kDefaultPauseBudget;
+    GarbageCollector::SetThreshold(threshold);
+    GarbageCollector::SetPauseBudget(std::chrono::microseconds(pauseBudget));
+}
+
+
+KARINA_TEST(UnreachableObjectsAreCounted)
+{
+#if defined(KARINA_MARK_SWEEP)
+    Test::Reclaim();
+    GarbageCollectorStatistics before = GarbageCollector::GetStatistics();
+
+    for (std::size_t i = 0; i < 100; ++i) {
+        Value::MakeArray(Value::MakeString("garbage, long enough to be made", 31));
+    }
+
+    Test::Reclaim();
+    GarbageCollectorStatistics after = GarbageCollector::GetStatistics();
+    KARINA_CHECK(after.collectionCount > before.collectionCount);
+#   if defined(KARINA_NURSERY)
+    // Young garbage is left behind rather than swept.
+    KARINA_CHECK(after.youngCollectionCount > before.youngCollectionCount);
+#   else
+    KARINA_CHECK(after.objectCount - before.objectCount >= 200);
+#   endif
+#endif
+}
+
+
+std::uint64_t
+ReadVarint(std::istream &stream)
+{
+    std::uint64_t x = 0;
+
+    for (int shift = 0;; shift += 7) {
+        int byte = stream.get();
+        KARINA_CHECK(byte != std::char_traits<char>::eof());
+        x |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0) {
+            return x;
+        }
+    }
+}
+
+
+KARINA_TEST(SnapshotsHoldEveryLiveObject)
+{
+    Test::Roots<1> roots;
+    roots[0] = Value::MakeArray(Value::MakeString("rooted, and long enough", 23));
+    // Held by nothing but itself.
+    Value immortal = Value::MakeArray(Value::MakeString("held by an immortal array", 25));
+    immortal.makeImmortal();
+    Value passed = Value::MakeString("passed in to the snapshot", 25);
+
+    std::stringstream stream;
+    KARINA_CHECK(Heap::WriteSnapshot(stream, &passed, 1));
+    char magic[4];
+    KARINA_CHECK(stream.read(magic, sizeof magic) && std::memcmp(magic, "KHS1", 4) == 0);
+    std::vector<std::uint64_t> rootIds;
+    // Types, flags and edge counts, by id.
+    std::vector<int> types;
+    std::vector<int> flags;
+    std::vector<std::uint64_t> edgeCounts;
+    std::size_t objectCount = 0;
+
+    for (int tag = stream.get(); tag != Heap::kEndRecord; tag = stream.get()) {
+        if (tag == Heap::kRootRecord) {
+            rootIds.push_back(ReadVarint(stream));
+            continue;
+        }
+
+        KARINA_CHECK(tag == Heap::kObjectRecord);
+        std::uint64_t id = ReadVarint(stream);
+        types.resize(std::max<std::size_t>(types.size(), id + 1));
+        flags.resize(types.size());
+        edgeCounts.resize(types.size());
+        types[id] = stream.get();
+        flags[id] = stream.get();
+        ReadVarint(stream);
+        edgeCounts[id] = ReadVarint(stream);
+
+        for (std::uint64_t i = 0; i < edgeCounts[id] * 2; ++i) {
+            ReadVarint(stream);
+        }
+
+        ++objectCount;
+    }
+
+    KARINA_CHECK(objectCount == types.size());
+    std::size_t immortalRootCount = 0;
+
+    for (std::uint64_t rootId : rootIds) {
+        if ((flags[rootId] & Heap::kSnapshotImmortalFlag) != 0) {
+            KARINA_CHECK(types[rootId] == 1 && edgeCounts[rootId] == 1);
+            ++immortalRootCount;
+        }
+    }
+
+#if defined(KARINA_MARK_SWEEP)
+    // Marking takes it for a root, so must the snapshot.
+    KARINA_CHECK(immortalRootCount >= 1);
+    // The passed in string, both arrays and their elements at least.
+    KARINA_CHECK(objectCount >= 5);
+#else
+    KARINA_CHECK(immortalRootCount == 0 && objectCount == 1);
+#endif
+}
+
+
+#if defined(KARINA_HEAP_STATISTICS)
+KARINA_TEST(HeapStatisticsFollowLiveObjects)
+{
+    Test::Reclaim();
+    std::size_t liveCount = Heap::GetStatistics().strings.liveCount;
+    {
+        Test::Roots<1> roots;
+        roots[0] = Value::MakeString("counted while it lives, at least", 32);
+        KARINA_CHECK(Heap::GetStatistics().strings.liveCount == liveCount + 1);
+    }
+
+    Test::Reclaim();
+    KARINA_CHECK(Heap::GetStatistics().strings.liveCount == liveCount);
+    KARINA_CHECK(Heap::DumpStatistics().find("\"strings\"") != std::string::npos);
+}
+#endif
+
+
+#if defined(KARINA_MEMORY_QUOTA)
+KARINA_TEST(HardLimitThrows)
+{
+    Test::Reclaim();
+    MemoryQuota::SetLimits(SIZE_MAX, MemoryQuota::GetUsedSize() + 1024);
+    bool hasThrown = false;
+
+    try {
+        std::string characters(4096, 'q');
+        Value::MakeString(characters.data(), characters.size());
+    } catch (const OutOfMemory &outOfMemory) {
+        hasThrown = outOfMemory.getRequestedSize() >= 4096;
+    }
+
+    MemoryQuota::SetLimits(SIZE_MAX, SIZE_MAX);
+    KARINA_CHECK(hasThrown);
+}
+#endif
+
+} // namespace
@@ -0,0 +1,316 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Test.hxx"
+
+
+namespace {
+
+using namespace Karina;
+
+
+KARINA_TEST(ContainersComeAndGo)
+{
+    std::vector<Value> copies;
+    {
+        Value values[] = {
+            Value::MakeArray(),
+            Value::MakeDictionary(),
+            Value::MakeClosure(),
+            Value::MakeString("long enough to be on the heap", 29),
+        };
+
+        for (const Value &value : values) {
+            copies.push_back(value);
+        }
+
+        KARINA_CHECK(copies[0].getArray() == values[0].getArray());
+        KARINA_CHECK(copies[1].getDictionary() == values[1].getDictionary());
+        KARINA_CHECK(copies[2].getClosure() == values[2].getClosure());
+        KARINA_CHECK(copies[3].getString() == values[3].getString());
+    }
+
+    // Whichever copy goes last takes the object with it.
+    KARINA_CHECK(copies[0].isArray() && copies[1].isDictionary() && copies[2].isClosure());
+    KARINA_CHECK(copies[3].isString() && copies[3].getString()->getLength() == 29);
+}
+
+
+KARINA_TEST(ArraysHoldTheirElements)
+{
+    Value string = Value::MakeString("an element long enough", 22);
+    Value array = Value::MakeArray(Value(1ul), string, Value::MakeArray());
+    Array *elements = array.getArray();
+    KARINA_CHECK(elements->getLength() == 3);
+    KARINA_CHECK(*elements->getElements()[0].getInteger() == 1);
+    KARINA_CHECK(elements->getElements()[1].getString() == string.getString());
+    KARINA_CHECK(elements->getElements()[2].isArray());
+    KARINA_CHECK(elements->getElements()[2].getArray()->getLength() == 0);
+
+    // Elements go along with the array, unless held elsewhere.
+    elements->setElement(0, Value::MakeString("another element, replacing one", 30));
+    string = Value();
+    Value element = elements->getElements()[1];
+    array = Value();
+    KARINA_CHECK(std::string(element.getString()->getCharacters(), 22) == "an element long enough");
+}
+
+
+KARINA_TEST(StoredElementsSurviveCollections)
+{
+    Test::Roots<1> roots;
+    roots[0] = Value::MakeArray(Value(), Value(), Value(), Value(), Value(), Value(), Value(),
+                                Value());
+
+    for (std::size_t i = 0; i < 8; ++i) {
+        std::string characters = "element number " + std::to_string(i) + " of the array";
+        roots[0].getArray()->setElement(i, Value::MakeString(characters.data(),
+                                                             characters.size()));
+        GarbageCollector::Poll();
+    }
+
+    Test::Reclaim();
+    Array *array = roots[0].getArray();
+
+    for (std::size_t i = 0; i < 8; ++i) {
+        std::string characters = "element number " + std::to_string(i) + " of the array";
+        String *string = array->getElements()[i].getString();
+        KARINA_CHECK(std::string(string->getCharacters(), string->getLength()) == characters);
+    }
+}
+
+
+KARINA_TEST(ImmortalObjectsOutliveTheirCopies)
+{
+    Array *empty = Array::New();
+    KARINA_CHECK(empty->getLength() == 0 && empty == Array::New());
+    KARINA_CHECK(Value::MakeArray().getArray() == empty);
+
+    Value array = Value::MakeArray(Value::MakeString("kept for the whole run", 22));
+    Array *immortal = array.getArray();
+    array.makeImmortal();
+    {
+        Value copy = array;
+        copy.share();
+    }
+
+    array = Value();
+    Value element = immortal->getElements()[0];
+    KARINA_CHECK(element.getString()->getLength() == 22);
+}
+
+
+KARINA_TEST(DictionariesAndClosuresComeAndGo)
+{
+    Test::Roots<4> roots;
+    roots[0] = Value::MakeDictionary();
+    roots[1] = Value::MakeClosure();
+    roots[2] = Value::MakeWeakReference(roots[0]);
+    roots[3] = Value::MakeWeakReference(roots[1]);
+    KARINA_CHECK(roots[0].isDictionary() && roots[1].isClosure());
+
+    roots[0] = Value();
+    roots[1] = Value();
+    Test::Reclaim();
+    KARINA_CHECK(roots[2].getWeakReference()->isCleared());
+    KARINA_CHECK(roots[3].getWeakReference()->isCleared());
+}
+
+
+KARINA_TEST(MakingImmortalTwiceIsHarmless)
+{
+    Value array = Value::MakeArray(Value::MakeString("kept for the whole run", 22));
+    array.makeImmortal();
+    array.makeImmortal();
+    Value copy = array;
+    copy = Value();
+    Test::Reclaim();
+    KARINA_CHECK(array.getArray()->getLength() == 1);
+
+    static constexpr StaticString<24> kConstant("already immortal, static");
+    Value constant = kConstant.get();
+    constant.makeImmortal();
+    KARINA_CHECK(constant.getString()->getLength() == 24);
+}
+
+
+#if defined(KARINA_CYCLE_COLLECTOR) || defined(KARINA_MARK_SWEEP)
+KARINA_TEST(CyclesAreReclaimed)
+{
+    Test::Reclaim();
+    Test::Roots<1> weakRoots;
+    {
+        Test::Roots<1> roots;
+        roots[0] = Value::MakeArray(Value(), Value());
+        roots[0].getArray()->setElement(0, roots[0]);
+        roots[0].getArray()->setElement(1, Value::MakeArray(roots[0]));
+        Test::Reclaim();
+        Array *array = roots[0].getArray();
+        KARINA_CHECK(array->getElements()[0].getArray() == array);
+        KARINA_CHECK(array->getElements()[1].getArray()->getElements()[0].getArray() == array);
+        weakRoots[0] = Value::MakeWeakReference(roots[0]);
+    }
+
+#   if defined(KARINA_CYCLE_COLLECTOR)
+    CycleCollectorStatistics statistics = CycleCollector::Collect();
+    KARINA_CHECK(statistics.cycleCount == 1 && statistics.objectCount == 2);
+#   else
+    GarbageCollectorStatistics statistics = GarbageCollector::Collect();
+    KARINA_CHECK(statistics.objectCount == 2);
+#   endif
+    KARINA_CHECK(weakRoots[0].getWeakReference()->isCleared());
+}
+#endif
+
+
+#if defined(KARINA_DEFERRED_RELEASE) || defined(KARINA_MARK_SWEEP)
+KARINA_TEST(DeepNestingIsReleasedWithoutRecursion)
+{
+    Test::Roots<1> weakRoots;
+    {
+        Test::Roots<1> roots;
+
+        for (std::size_t i = 0; i < 100000; ++i) {
+            roots[0] = Value::MakeArray(roots[0]);
+            GarbageCollector::Poll();
+        }
+
+        weakRoots[0] = Value::MakeWeakReference(roots[0]);
+    }
+
+    Test::Reclaim();
+    KARINA_CHECK(weakRoots[0].getWeakReference()->isCleared());
+#   if defined(KARINA_DEFERRED_RELEASE)
+    KARINA_CHECK(ReleaseQueue::GetLength() == 0);
+
+    // Left to Drain() altogether.
+    ReleaseQueue::SetBudget(0);
+    Value array = Value::MakeArray(Value::MakeArray(), Value::MakeDictionary());
+    array = Value();
+    KARINA_CHECK(ReleaseQueue::GetLength() >= 1);
+    KARINA_CHECK(ReleaseQueue::Drain());
+    KARINA_CHECK(ReleaseQueue::GetLength() == 0);
+    ReleaseQueue::SetBudget(16);
+#   endif
+}
+#endif
+
+
+#if defined(KARINA_DEFERRED_RELEASE)
+KARINA_TEST(QueuedReleasesAreDrainedAtThreadExit)
+{
+    std::thread([] {
+        // Made before the tables draining touches.
+        ReleaseQueue::SetBudget(0);
+        Value string = Value::MakeInternedString("queued until the thread exits", 29);
+        Value array = Value::MakeArray(string, Value::MakeWeakReference(string));
+        string = Value();
+        array = Value();
+        KARINA_CHECK(ReleaseQueue::GetLength() == 1);
+    }).join();
+}
+#endif
+
+
+#if defined(KARINA_ARENA_SCOPES)
+KARINA_TEST(EscapedValuesOutliveTheirArena)
+{
+    Value escaped;
+    {
+        ArenaScope arenaScope;
+        Value string = Value::MakeString("made in the arena, long enough", 30);
+        Value array = Value::MakeArray(string, Value::MakeArray(string));
+        escaped = ArenaScope::Escape(array);
+    }
+
+    Array *array = escaped.getArray();
+    KARINA_CHECK(array->getLength() == 2);
+    String *string = array->getElements()[0].getString();
+    KARINA_CHECK(std::string(string->getCharacters(), string->getLength())
+                 == "made in the arena, long enough");
+    KARINA_CHECK(array->getElements()[1].getArray()->getLength() == 1);
+}
+#endif
+
+
+#if defined(KARINA_ATOMIC_COPY_COUNTER) || defined(KARINA_HYBRID_COPY_COUNTER) \
+    || defined(KARINA_BIASED_COPY_COUNTER)
+KARINA_TEST(SharedObjectsGoWithTheirLastCopy)
+{
+    std::vector<std::thread> threads;
+    {
+        Value string = Value::MakeString("copied back and forth by threads", 32);
+        Value dictionary = Value::MakeDictionary();
+        string.share();
+        dictionary.share();
+
+        for (std::size_t i = 0; i < 4; ++i) {
+            threads.emplace_back([string, dictionary] {
+                for (std::size_t j = 0; j < 10000; ++j) {
+                    Value stringCopy(string);
+                    Value dictionaryCopy(dictionary);
+                    KARINA_CHECK(stringCopy.getString()->getLength() == 32);
+                    KARINA_CHECK(dictionaryCopy.isDictionary());
+                }
+            });
+        }
+    }
+
+    // Whichever thread ends last releases both, unless it has to leave
+    // that to this one.
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    CopyCounter::MergeQueued();
+}
+#endif
+
+
+#if defined(KARINA_BIASED_COPY_COUNTER)
+// Of all size classes, on the calling thread.
+std::size_t
+GetUsedBlockCount()
+{
+    std::size_t usedBlockCount = 0;
+
+    for (std::size_t i = 0; i < Pool::kSizeClassCount; ++i) {
+        PoolStatistics statistics = Pool::GetStatistics(i);
+        usedBlockCount += statistics.blockCount - statistics.freeBlockCount;
+    }
+
+    return usedBlockCount;
+}
+
+
+KARINA_TEST(QueuedReleasesAreMerged)
+{
+    static constexpr std::size_t kStringCount = 100;
+
+    std::thread([] {
+        std::vector<Value> strings;
+        std::vector<Value> handedOver;
+
+        for (std::size_t i = 0; i < kStringCount; ++i) {
+            std::string characters = "string " + std::to_string(i) + " of the owning thread";
+            strings.push_back(Value::MakeString(characters.data(), characters.size()));
+            handedOver.push_back(strings.back());
+        }
+
+        std::size_t usedBlockCount = GetUsedBlockCount();
+        // Each is left with a copy it does not own, which goes to the queue
+        // of this thread.
+        std::thread([&handedOver] {
+            handedOver.clear();
+        }).join();
+
+        strings.clear();
+        KARINA_CHECK(GetUsedBlockCount() == usedBlockCount);
+        CopyCounter::MergeQueued();
+        KARINA_CHECK(GetUsedBlockCount() == usedBlockCount - kStringCount);
+    }).join();
+}
+#endif
+
+} // namespace
@@ -0,0 +1,8 @@
+#include "Test.hxx"
+
+
+int
+main()
+{
+    return Karina::Test::Registration::RunAll();
+}
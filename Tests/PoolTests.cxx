@@ -0,0 +1,101 @@
+#include <cstring>
+#include <thread>
+
+#include "Test.hxx"
+
+
+namespace {
+
+using namespace Karina;
+
+
+std::size_t
+GetUsedBlockCount(const PoolStatistics &statistics)
+{
+    return statistics.blockCount - statistics.freeBlockCount;
+}
+
+
+KARINA_TEST(FreedBlocksAreReused)
+{
+    static constexpr std::size_t kBlockCount = 1000;
+    // Of 24-byte blocks, which are rounded up to 32 bytes.
+    static constexpr std::size_t kSizeClass = 1;
+
+    PoolStatistics before = Pool::GetStatistics(kSizeClass);
+    KARINA_CHECK(before.blockSize == 32);
+    void *blocks[kBlockCount];
+
+    for (void *&block : blocks) {
+        block = Pool::Allocate(24);
+        std::memset(block, 0xAB, 24);
+    }
+
+    PoolStatistics allocated = Pool::GetStatistics(kSizeClass);
+    KARINA_CHECK(GetUsedBlockCount(allocated) == GetUsedBlockCount(before) + kBlockCount);
+    KARINA_CHECK(allocated.chunkCount >= 2);
+
+    for (void *block : blocks) {
+        Pool::Free(block, 24);
+    }
+
+    KARINA_CHECK(GetUsedBlockCount(Pool::GetStatistics(kSizeClass))
+                 == GetUsedBlockCount(before));
+
+    for (void *&block : blocks) {
+        block = Pool::Allocate(17);
+    }
+
+    PoolStatistics reused = Pool::GetStatistics(kSizeClass);
+    KARINA_CHECK(reused.blockCount == allocated.blockCount);
+    KARINA_CHECK(reused.chunkCount == allocated.chunkCount);
+
+    for (void *block : blocks) {
+        Pool::Free(block, 17);
+    }
+
+    // Too large for any size class.
+    void *block = Pool::Allocate(Pool::kMaxBlockSize + 1);
+    std::memset(block, 0xCD, Pool::kMaxBlockSize + 1);
+    Pool::Free(block, Pool::kMaxBlockSize + 1);
+}
+
+KARINA_TEST(BlocksOutliveTheirThread)
+{
+    static constexpr std::size_t kBlockCount = 100;
+    // Of the largest blocks, which no other test allocates on its own.
+    static constexpr std::size_t kSizeClass = Pool::kSizeClassCount - 1;
+
+    void *blocks[kBlockCount];
+    PoolStatistics exited;
+
+    std::thread([&blocks, &exited] {
+        for (void *&block : blocks) {
+            block = Pool::Allocate(Pool::kMaxBlockSize);
+        }
+
+        // Released below, on this thread.
+        for (std::size_t i = 0; i < kBlockCount / 2; ++i) {
+            Pool::Free(blocks[i], Pool::kMaxBlockSize);
+        }
+
+        exited = Pool::GetStatistics(kSizeClass);
+    }).join();
+
+    // A new thread takes over its chunks and free blocks rather than adding
+    // chunks of its own.
+    std::thread([&exited] {
+        void *block = Pool::Allocate(Pool::kMaxBlockSize);
+        PoolStatistics adopted = Pool::GetStatistics(kSizeClass);
+        KARINA_CHECK(adopted.chunkCount >= exited.chunkCount);
+        KARINA_CHECK(adopted.blockCount - adopted.freeBlockCount
+                     >= exited.blockCount - exited.freeBlockCount + 1);
+        Pool::Free(block, Pool::kMaxBlockSize);
+    }).join();
+
+    for (std::size_t i = kBlockCount / 2; i < kBlockCount; ++i) {
+        Pool::Free(blocks[i], Pool::kMaxBlockSize);
+    }
+}
+
+} // namespace
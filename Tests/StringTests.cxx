@@ -0,0 +1,328 @@
+#include <cstring>
+#include <initializer_list>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "Test.hxx"
+
+
+namespace {
+
+using namespace Karina;
+
+
+static constexpr StaticString<6> kReturn("return");
+static constexpr StaticString<36> kLongLiteral("a literal that is too long to inline");
+static constexpr StaticString<36> kUtf8Literal("caf\xC3\xA9 au lait, to be taken with care");
+static constexpr StaticString<31> kBinaryLiteral("not quite UTF-8, \xC0\xAF is overlong");
+
+// Static strings are classified at compile time.
+static_assert(Utf8::ClassifyConstant("plain", 5) == Encoding::Ascii, "");
+static_assert(Utf8::ClassifyConstant("\xE2\x82\xAC\xF0\x9F\x98\x80", 7) == Encoding::Utf8, "");
+static_assert(Utf8::ClassifyConstant("\xED\xA0\x80", 3) == Encoding::Binary, "");
+static_assert(Utf8::ClassifyConstant("\xF4\x90\x80\x80", 4) == Encoding::Binary, "");
+static_assert(Utf8::ClassifyConstant("cut \xE2\x82", 6) == Encoding::Binary, "");
+
+
+std::string
+GetCharacters(Value &value)
+{
+    std::size_t length;
+    char *characters = value.getStringCharacters(&length);
+    return std::string(characters, length);
+}
+
+
+Value
+MakeString(const std::string &characters)
+{
+    return Value::MakeString(characters.data(), characters.size());
+}
+
+
+KARINA_TEST(StringsOfAnyLengthReadBack)
+{
+    for (std::size_t length = 0; length < 40; ++length) {
+        std::string characters;
+
+        for (std::size_t i = 0; i < length; ++i) {
+            characters += static_cast<char>('a' + i % 26);
+        }
+
+        Value value = MakeString(characters);
+        Value copy(value);
+        KARINA_CHECK(value.isString() && copy.isString());
+        // Inlined up to 5 characters at least, 14 at most.
+        KARINA_CHECK(length > 5 || value.getString() == nullptr);
+        KARINA_CHECK(length <= 14 || value.getString() != nullptr);
+        KARINA_CHECK(GetCharacters(value) == characters && GetCharacters(copy) == characters);
+        ValueRef valueRef(value);
+        std::size_t refLength;
+        KARINA_CHECK(valueRef.isString() && valueRef.getStringCharacters(&refLength)
+                     && refLength == length);
+    }
+}
+
+
+KARINA_TEST(ConcatenationsMixBothKinds)
+{
+    std::string shortCharacters = "abc";
+    std::string longCharacters(70, 'x');
+    Test::Roots<2> roots;
+    roots[0] = MakeString(shortCharacters);
+    roots[1] = MakeString(longCharacters);
+
+    Value pairs[][2] = {
+        {roots[0], roots[0]},
+        {roots[0], roots[1]},
+        {roots[1], roots[0]},
+        {roots[1], roots[1]},
+    };
+    std::string expected[] = {
+        shortCharacters + shortCharacters,
+        shortCharacters + longCharacters,
+        longCharacters + shortCharacters,
+        longCharacters + longCharacters,
+    };
+
+    for (std::size_t i = 0; i < 4; ++i) {
+        Value concatenation = Value::Concatenate(pairs[i][0], pairs[i][1]);
+        KARINA_CHECK(concatenation.isString() && GetCharacters(concatenation) == expected[i]);
+    }
+
+    Value empty = Value::MakeString("", 0);
+    Value same = Value::Concatenate(empty, roots[1]);
+    KARINA_CHECK(same.getString() == roots[1].getString());
+}
+
+
+KARINA_TEST(LongConcatenationChainsStayIntact)
+{
+    Test::Roots<1> roots;
+    std::string expected;
+    roots[0] = Value::MakeString("", 0);
+
+    for (std::size_t i = 0; i < 2000; ++i) {
+        std::string piece = "piece " + std::to_string(i) + " of a long chain; ";
+        expected += piece;
+        roots[0] = Value::Concatenate(roots[0], MakeString(piece));
+
+        if (i % 100 == 0) {
+            GarbageCollector::Poll();
+        }
+    }
+
+    Test::Reclaim();
+    KARINA_CHECK(roots[0].getString()->getLength() == expected.size());
+    KARINA_CHECK(GetCharacters(roots[0]) == expected);
+}
+
+
+KARINA_TEST(SubstringsOfBothKinds)
+{
+    std::string characters = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    Test::Roots<3> roots;
+    roots[0] = MakeString(characters);
+    roots[1] = Value::Substring(roots[0], 4, 50);
+    roots[2] = Value::Substring(roots[1], 10, 33);
+    Value shortOne = Value::Substring(roots[2], 3, 5);
+    Value shorter = Value::Substring(shortOne, 1, 2);
+    roots[0] = Value();
+
+    Test::Reclaim();
+    KARINA_CHECK(GetCharacters(roots[1]) == characters.substr(4, 50));
+    KARINA_CHECK(GetCharacters(roots[2]) == characters.substr(14, 33));
+    KARINA_CHECK(GetCharacters(shortOne) == characters.substr(17, 5));
+    KARINA_CHECK(GetCharacters(shorter) == characters.substr(18, 2));
+}
+
+
+KARINA_TEST(EqualStringsHashAlike)
+{
+    std::string characters(100, 'h');
+    Value flat = MakeString(characters);
+    Value halves = Value::Concatenate(MakeString(characters.substr(0, 60)),
+                                      MakeString(characters.substr(60)));
+    Value slice = Value::Substring(MakeString(characters + "tail"), 0, characters.size());
+    KARINA_CHECK(flat.getString()->getHash() == halves.getString()->getHash());
+    KARINA_CHECK(flat.getString()->getHash() == slice.getString()->getHash());
+    KARINA_CHECK(flat.getString()->getHash() == String::Hash(characters.data(), characters.size()));
+    KARINA_CHECK(flat.getString()->equals(halves.getString()));
+    KARINA_CHECK(slice.getString()->equals(flat.getString()));
+}
+
+
+KARINA_TEST(InternedStringsAreOneObject)
+{
+    const char identifier[] = "identifier_long";
+    const char other[] = "identifier_else";
+    Test::Roots<4> roots;
+    roots[0] = Value::MakeInternedString(identifier, sizeof identifier - 1);
+    roots[1] = Value::MakeInternedString(identifier, sizeof identifier - 1);
+    roots[2] = Value::MakeInternedString(other, sizeof other - 1);
+    roots[3] = Value::MakeString(identifier, sizeof identifier - 1);
+    KARINA_CHECK(roots[0].getString() == roots[1].getString());
+    KARINA_CHECK(roots[0].getString()->isInterned());
+    KARINA_CHECK(!roots[0].getString()->equals(roots[2].getString()));
+    KARINA_CHECK(roots[3].getString()->equals(roots[0].getString()));
+
+    // Dropping every copy takes it out of the table.
+    roots[0] = Value();
+    roots[1] = Value();
+    Test::Reclaim();
+    roots[0] = Value::MakeInternedString(identifier, sizeof identifier - 1);
+    KARINA_CHECK(GetCharacters(roots[0]) == identifier);
+    KARINA_CHECK(roots[0].getString()->equals(roots[3].getString()));
+}
+
+
+KARINA_TEST(EncodingsAreClassified)
+{
+    std::string ascii(300, 'a');
+    std::string utf8;
+    std::string binary = std::string(40, 'b') + "\xFF\xFE";
+
+    for (std::size_t i = 0; i < 200; ++i) {
+        utf8 += i % 3 == 0 ? "\xE2\x82\xAC" : "e";
+    }
+
+    Value asciiValue = MakeString(ascii);
+    Value utf8Value = MakeString(utf8);
+    Value binaryValue = MakeString(binary);
+    KARINA_CHECK(asciiValue.getString()->isAscii() && asciiValue.getString()->isUtf8());
+    KARINA_CHECK(!utf8Value.getString()->isAscii() && utf8Value.getString()->isUtf8());
+    KARINA_CHECK(!binaryValue.getString()->isAscii() && !binaryValue.getString()->isUtf8());
+
+    String *string = utf8Value.getString();
+    KARINA_CHECK(string->getCodepointCount() == 200);
+    std::size_t offset = 0;
+
+    for (std::size_t i = 0; i <= 200; ++i) {
+        KARINA_CHECK(string->getCodepointOffset(i) == offset);
+        offset += i % 3 == 0 ? 3 : 1;
+    }
+
+    KARINA_CHECK(asciiValue.getString()->getCodepointOffset(123) == 123);
+
+    for (const std::string &characters : {ascii, utf8, binary}) {
+        KARINA_CHECK(Utf8::ClassifyConstant(characters.data(), characters.size())
+                     == Utf8::Classify(characters.data(), characters.size()));
+    }
+
+    // Made immortal, it is classified once and for all beforehand.
+    Value immortal = MakeString(utf8);
+    immortal.makeImmortal();
+    KARINA_CHECK(!immortal.getString()->isAscii() && immortal.getString()->isUtf8());
+}
+
+
+KARINA_TEST(EveryWayOfClassifyingAgrees)
+{
+    // Put together at random, so that sequences straddle vectors and the
+    // strings end anywhere.
+    static const char *const kValidPieces[] = {
+        "a",
+        "0123456789abcdef",
+        "\xC3\xA9",
+        "\xE2\x82\xAC",
+        "\xF0\x9F\x98\x80",
+    };
+    static const char *const kInvalidPieces[] = {
+        "\xC0\xAF",
+        "\x80",
+        "\xE2\x82",
+        "\xED\xA0\x80",
+        "\xF4\x90\x80\x80",
+        "\xFF",
+    };
+
+    std::mt19937 random(20161016);
+
+    for (std::size_t i = 0; i < 10000; ++i) {
+        std::string characters;
+        std::size_t pieceCount = random() % 40;
+
+        for (std::size_t j = 0; j < pieceCount; ++j) {
+            // Rarely, so that many of the strings are valid.
+            if (random() % 64 == 0) {
+                characters += kInvalidPieces[random() % 6];
+            } else {
+                characters += kValidPieces[random() % 5];
+            }
+        }
+
+        KARINA_CHECK(Utf8::Classify(characters.data(), characters.size())
+                     == Utf8::ClassifyConstant(characters.data(), characters.size()));
+    }
+}
+
+
+KARINA_TEST(StaticStringsAreImmortal)
+{
+    Value keyword = kReturn.get();
+    KARINA_CHECK(keyword.isString() && GetCharacters(keyword) == "return");
+
+    Test::Roots<1> roots;
+    roots[0] = kLongLiteral.get();
+    Value copy = kLongLiteral.get();
+    KARINA_CHECK(copy.getString() == roots[0].getString());
+    KARINA_CHECK(GetCharacters(copy) == "a literal that is too long to inline");
+    KARINA_CHECK(copy.getString()->isAscii());
+    KARINA_CHECK(copy.getString()->getHash()
+                 == String::Hash("a literal that is too long to inline", 36));
+    copy.makeImmortal();
+
+    Value utf8 = kUtf8Literal.get();
+    KARINA_CHECK(!utf8.getString()->isAscii() && utf8.getString()->isUtf8());
+    KARINA_CHECK(utf8.getString()->getCodepointCount() == 35);
+    Value binary = kBinaryLiteral.get();
+    KARINA_CHECK(!binary.getString()->isAscii() && !binary.getString()->isUtf8());
+
+    roots[0] = Value();
+    Test::Reclaim();
+    KARINA_CHECK(GetCharacters(copy) == "a literal that is too long to inline");
+}
+
+
+#if defined(KARINA_ATOMIC_COPY_COUNTER) || defined(KARINA_HYBRID_COPY_COUNTER) \
+    || defined(KARINA_BIASED_COPY_COUNTER)
+KARINA_TEST(SharedStringsCompareAcrossThreads)
+{
+    const char identifier[] = "identifier_long";
+    const char nestedIdentifier[] = "identifier_nested";
+    Value interned = Value::MakeInternedString(identifier, sizeof identifier - 1);
+    // Shared along with the array holding it.
+    Value array = Value::MakeArray(Value::MakeInternedString(nestedIdentifier,
+                                                             sizeof nestedIdentifier - 1));
+    Value concatenation = Value::Concatenate(MakeString(std::string(40, 'l')),
+                                             MakeString(std::string(40, 'r')));
+    interned.share();
+    concatenation.share();
+    array.share();
+    KARINA_CHECK(!array.getArray()->getElements()[0].getString()->isInterned());
+    Value shared = interned;
+
+    std::thread thread([&shared, &array, &concatenation, &identifier] {
+        Value local = Value::MakeInternedString(identifier, sizeof identifier - 1);
+        KARINA_CHECK(shared.getString()->equals(local.getString()));
+        KARINA_CHECK(local.getString()->equals(shared.getString()));
+        KARINA_CHECK(GetCharacters(concatenation) == std::string(40, 'l') + std::string(40, 'r'));
+        // Released here, against this thread's table.
+        shared = Value();
+        array = Value();
+    });
+    thread.join();
+
+    Value again = Value::MakeInternedString(identifier, sizeof identifier - 1);
+    KARINA_CHECK(again.getString()->equals(interned.getString()));
+    KARINA_CHECK(again.getString() == Value::MakeInternedString(identifier,
+                                                                sizeof identifier - 1).getString());
+    Value nested = Value::MakeInternedString(nestedIdentifier, sizeof nestedIdentifier - 1);
+    KARINA_CHECK(GetCharacters(nested) == nestedIdentifier);
+    KARINA_CHECK(nested.getString() == Value::MakeInternedString(
+        nestedIdentifier, sizeof nestedIdentifier - 1).getString());
+}
+#endif
+
+} // namespace
@@ -0,0 +1,167 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../Source/Value.hxx"
+
+
+// Every test file is built once per mode, see CMakeLists.txt, and the same
+// tests have to pass in all of them. A test is defined with
+//
+//     KARINA_TEST(IntegersReadBack)
+//     {
+//         ...
+//         KARINA_CHECK(*value.getInteger() == 42);
+//     }
+//
+// and tests run in the order they are defined. Whatever a test needs to
+// survive a collection has to be held in a Roots.
+#define KARINA_TEST(name)                                                       \
+    static void name();                                                         \
+    static const ::Karina::Test::Registration name##Registration(#name, &name); \
+    static void name()
+
+#define KARINA_CHECK(condition)                                   \
+    do {                                                          \
+        if (!(condition)) {                                       \
+            ::Karina::Test::Fail(__FILE__, __LINE__, #condition); \
+        }                                                         \
+    } while (false)
+
+
+namespace Karina {
+
+namespace Test {
+
+class Registration final
+{
+    Registration(const Registration &) = delete;
+    void operator=(const Registration &) = delete;
+
+public:
+    inline explicit Registration(const char *, void (*)());
+
+    inline static int RunAll();
+
+private:
+    struct Entry
+    {
+        const char *name;
+        void (*function)();
+    };
+
+    inline static std::vector<Entry> &GetEntries();
+};
+
+
+// Values registered as garbage collector roots for as long as it lives,
+// all null at first.
+template<std::size_t N>
+class Roots final
+{
+    Roots(const Roots &) = delete;
+    void operator=(const Roots &) = delete;
+
+public:
+    inline explicit Roots();
+    inline ~Roots();
+
+    inline Value &operator[](std::size_t);
+    inline std::size_t getLength() const;
+
+private:
+    Value values_[N];
+};
+
+
+[[noreturn]] inline void Fail(const char *, int, const char *);
+// Reclaims whatever is no longer held by roots, as far as the mode
+// reclaims anything on demand at all.
+inline void Reclaim();
+
+
+Registration::Registration(const char *name, void (*function)())
+{
+    GetEntries().push_back({name, function});
+}
+
+
+int
+Registration::RunAll()
+{
+    for (const Entry &entry : GetEntries()) {
+        std::printf("%s\n", entry.name);
+        std::fflush(stdout);
+        entry.function();
+        Reclaim();
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+std::vector<Registration::Entry> &
+Registration::GetEntries()
+{
+    static std::vector<Entry> entries;
+    return entries;
+}
+
+
+template<std::size_t N>
+Roots<N>::Roots()
+{
+    GarbageCollector::AddRoots(values_, N);
+}
+
+
+template<std::size_t N>
+Roots<N>::~Roots()
+{
+    GarbageCollector::RemoveRoots(values_);
+}
+
+
+template<std::size_t N>
+Value &
+Roots<N>::operator[](std::size_t index)
+{
+    return values_[index];
+}
+
+
+template<std::size_t N>
+std::size_t
+Roots<N>::getLength() const
+{
+    return N;
+}
+
+
+void
+Fail(const char *fileName, int lineNumber, const char *condition)
+{
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", fileName, lineNumber, condition);
+    std::abort();
+}
+
+
+void
+Reclaim()
+{
+    GarbageCollector::Collect();
+#if defined(KARINA_CYCLE_COLLECTOR)
+    CycleCollector::Collect();
+#endif
+#if defined(KARINA_DEFERRED_RELEASE)
+    ReleaseQueue::Drain();
+#endif
+}
+
+} // namespace Test
+
+} // namespace Karina
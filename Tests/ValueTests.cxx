@@ -0,0 +1,201 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "Test.hxx"
+
+
+namespace {
+
+using namespace Karina;
+
+
+struct TypeNamer
+{
+    std::string operator()(std::nullptr_t) { return "null"; }
+    std::string operator()(bool *) { return "boolean"; }
+    std::string operator()(Value::IntegerPointer) { return "integer"; }
+    std::string operator()(Value::FloatingPointPointer) { return "floating point"; }
+    std::string operator()(char *characters, std::size_t length)
+    {
+        return "string " + std::string(characters, length);
+    }
+    std::string operator()(Array *) { return "array"; }
+    std::string operator()(Dictionary *) { return "dictionary"; }
+    std::string operator()(Closure *) { return "closure"; }
+    std::string operator()(WeakReference *) { return "weak reference"; }
+};
+
+
+KARINA_TEST(ScalarsReadBack)
+{
+    Value null;
+    Value boolean(true);
+    Value integer(42ul);
+    Value floatingPoint(2.5);
+    KARINA_CHECK(null.isNull());
+    KARINA_CHECK(boolean.isBoolean() && *boolean.getBoolean());
+    KARINA_CHECK(integer.isInteger() && *integer.getInteger() == 42);
+    KARINA_CHECK(floatingPoint.isFloatingPoint() && *floatingPoint.getFloatingPoint() == 2.5);
+
+    *integer.getInteger() = 7;
+    *floatingPoint.getFloatingPoint() = -0.5;
+    KARINA_CHECK(integer.isInteger() && *integer.getInteger() == 7);
+    KARINA_CHECK(floatingPoint.isFloatingPoint() && *floatingPoint.getFloatingPoint() == -0.5);
+}
+
+
+KARINA_TEST(FloatingPointSpecialsStayFloatingPoint)
+{
+    const double specials[] = {
+        0.0,
+        -0.0,
+        std::numeric_limits<double>::infinity(),
+        -std::numeric_limits<double>::infinity(),
+        std::numeric_limits<double>::denorm_min(),
+        std::numeric_limits<double>::max(),
+    };
+
+    for (double special : specials) {
+        Value value(special);
+        KARINA_CHECK(value.isFloatingPoint());
+        double readBack = *value.getFloatingPoint();
+        KARINA_CHECK(std::memcmp(&readBack, &special, sizeof special) == 0);
+    }
+
+    // Whatever the payload, NaNs must not read back as anything else.
+    const std::uint64_t nanBits[] = {
+        UINT64_C(0x7FF8000000000000),
+        UINT64_C(0xFFF8000000000000),
+        UINT64_C(0xFFF8800000000001),
+        UINT64_C(0xFFFFFFFFFFFFFFFF),
+        UINT64_C(0x7FF0000000000001),
+    };
+
+    for (std::uint64_t bits : nanBits) {
+        double nan;
+        std::memcpy(&nan, &bits, sizeof nan);
+        Value value(nan);
+        KARINA_CHECK(value.isFloatingPoint() && std::isnan(*value.getFloatingPoint()));
+
+        Value stored(0.0);
+        *stored.getFloatingPoint() = nan;
+        KARINA_CHECK(stored.isFloatingPoint() && std::isnan(*stored.getFloatingPoint()));
+    }
+}
+
+
+KARINA_TEST(WideIntegersDoNotCorruptTheType)
+{
+#if defined(KARINA_NAN_BOXING)
+    const unsigned long maxInteger = (1ul << 47) - 1;
+    Value value(maxInteger);
+    KARINA_CHECK(value.isInteger() && *value.getInteger() == maxInteger);
+
+    bool hasThrown = false;
+
+    try {
+        Value tooWide(maxInteger + 1);
+    } catch (const std::out_of_range &) {
+        hasThrown = true;
+    }
+
+    KARINA_CHECK(hasThrown);
+    hasThrown = false;
+
+    try {
+        *value.getInteger() = ~0ul;
+    } catch (const std::out_of_range &) {
+        hasThrown = true;
+    }
+
+    KARINA_CHECK(hasThrown);
+    KARINA_CHECK(value.isInteger() && *value.getInteger() == maxInteger);
+#else
+    Value value(~0ul);
+    KARINA_CHECK(value.isInteger() && *value.getInteger() == ~0ul);
+#endif
+}
+
+
+KARINA_TEST(CopiesAndMovesKeepTheObject)
+{
+    Value original = Value::MakeString("long enough to be on the heap", 29);
+    String *string = original.getString();
+
+    Value copy(original);
+    KARINA_CHECK(copy.isString() && copy.getString() == string);
+    Value moved(std::move(copy));
+    KARINA_CHECK(moved.isString() && moved.getString() == string);
+    const Value constant = original;
+    Value assigned(1.5);
+    assigned = constant;
+    assigned = assigned;
+    KARINA_CHECK(assigned.isString() && assigned.getString() == string);
+
+    // The old object may be what holds the new one.
+    Value array = Value::MakeArray();
+    array = std::move(original);
+    original = Value(3ul);
+    moved = Value();
+    KARINA_CHECK(array.isString() && array.getString() == string);
+    KARINA_CHECK(original.isInteger() && *original.getInteger() == 3);
+    KARINA_CHECK(assigned.getString()->getLength() == 29);
+}
+
+
+KARINA_TEST(VisitorsSeeEveryType)
+{
+    Value values[] = {
+        Value(),
+        Value(false),
+        Value(3ul),
+        Value(1.5),
+        Value::MakeString("short", 5),
+        Value::MakeString("a string too long to be inlined", 31),
+        Value::MakeArray(),
+        Value::MakeDictionary(),
+        Value::MakeClosure(),
+    };
+    const char *names[] = {
+        "null",
+        "boolean",
+        "integer",
+        "floating point",
+        "string short",
+        "string a string too long to be inlined",
+        "array",
+        "dictionary",
+        "closure",
+    };
+
+    for (std::size_t i = 0; i < sizeof values / sizeof values[0]; ++i) {
+        KARINA_CHECK(values[i].visit(TypeNamer()) == names[i]);
+    }
+
+    Value weakReference = Value::MakeWeakReference(values[5]);
+    KARINA_CHECK(weakReference.visit(TypeNamer()) == "weak reference");
+}
+
+
+KARINA_TEST(ReferencesAreDereferenced)
+{
+    Value target(5ul);
+    Value reference(&target);
+    KARINA_CHECK(reference.tryDereference() == &target);
+    KARINA_CHECK(target.tryDereference() == &target);
+    KARINA_CHECK(reference.visit(TypeNamer()) == "integer");
+
+    ValueRef valueRef(reference);
+    KARINA_CHECK(valueRef.isInteger() && *valueRef.getInteger() == 5);
+    *valueRef.getInteger() = 6;
+    KARINA_CHECK(*target.getInteger() == 6);
+    Value copy = valueRef.toValue();
+    KARINA_CHECK(copy.isInteger() && *copy.getInteger() == 6);
+}
+
+} // namespace
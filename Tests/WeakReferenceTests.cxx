@@ -0,0 +1,115 @@
+#include <string>
+#include <thread>
+
+#include "Test.hxx"
+
+
+namespace {
+
+using namespace Karina;
+
+
+KARINA_TEST(WeakReferencesFollowTheirObject)
+{
+    Test::Roots<3> roots;
+    roots[0] = Value::MakeString("the object weakly referred to", 29);
+    roots[1] = Value::MakeWeakReference(roots[0]);
+    roots[2] = Value::MakeWeakReference(roots[0]);
+    // One per object, so that they may key weak tables.
+    KARINA_CHECK(roots[1].getWeakReference() == roots[2].getWeakReference());
+
+    // The nursery may move the object meanwhile.
+    Test::Reclaim();
+    KARINA_CHECK(!roots[1].getWeakReference()->isCleared());
+    Value value = roots[1].getWeakReference()->get();
+    KARINA_CHECK(value.isString() && value.getString() == roots[0].getString());
+    value = Value();
+
+    roots[0] = Value();
+    Test::Reclaim();
+    KARINA_CHECK(roots[1].getWeakReference()->isCleared());
+    KARINA_CHECK(roots[1].getWeakReference()->get().isNull());
+
+    roots[0] = Value::MakeString("a new object for a new reference", 32);
+    roots[2] = Value::MakeWeakReference(roots[0]);
+    KARINA_CHECK(roots[2].getWeakReference() != roots[1].getWeakReference());
+    KARINA_CHECK(!roots[2].getWeakReference()->isCleared());
+}
+
+
+KARINA_TEST(WeakReferencesHoldOnToWhatCannotDie)
+{
+    static constexpr StaticString<27> kConstant("a constant that never dies!");
+    Test::Roots<4> roots;
+    roots[0] = Value::MakeWeakReference(Value(12ul));
+    roots[1] = Value::MakeWeakReference(Value::MakeString("short", 5));
+    roots[2] = Value::MakeWeakReference(kConstant.get());
+    roots[3] = Value::MakeWeakReference(Value());
+
+    Test::Reclaim();
+    KARINA_CHECK(*roots[0].getWeakReference()->get().getInteger() == 12);
+    KARINA_CHECK(roots[1].getWeakReference()->get().isString());
+    KARINA_CHECK(roots[2].getWeakReference()->get().getString()->getLength() == 27);
+    KARINA_CHECK(roots[3].getWeakReference()->get().isNull());
+}
+
+
+KARINA_TEST(WeakReferencesOutliveTheirObjectInAnyOrder)
+{
+    Test::Roots<16> roots;
+
+    for (std::size_t round = 0; round < 64; ++round) {
+        for (std::size_t i = 0; i < 8; ++i) {
+            std::string characters = "object " + std::to_string(round * 8 + i) + " of many";
+            roots[i] = Value::MakeString(characters.data(), characters.size());
+            roots[8 + i] = Value::MakeWeakReference(roots[i]);
+        }
+
+        // Drop objects and weak references alike, in turn.
+        for (std::size_t i = 0; i < 8; ++i) {
+            roots[round % 2 == 0 ? i : 8 + i] = Value();
+        }
+
+        Test::Reclaim();
+
+        for (std::size_t i = 8; i < 16; ++i) {
+            KARINA_CHECK(roots[i].isNull() || roots[i].getWeakReference()->isCleared());
+        }
+    }
+}
+
+
+#if defined(KARINA_ATOMIC_COPY_COUNTER) || defined(KARINA_HYBRID_COPY_COUNTER) \
+    || defined(KARINA_BIASED_COPY_COUNTER)
+KARINA_TEST(SharingClearsWeakReferences)
+{
+    Value object = Value::MakeString("an object handed to another thread", 34);
+    Value weakReference = Value::MakeWeakReference(object);
+    Value otherWeakReference = Value::MakeWeakReference(
+        Value::MakeString("another object, weakly referred to", 34));
+    object.share();
+    KARINA_CHECK(weakReference.getWeakReference()->isCleared());
+    KARINA_CHECK(Value::MakeWeakReference(object).getWeakReference()->isCleared());
+
+    otherWeakReference.share();
+
+    // Whatever a shared object holds is shared along with it.
+    Value element = Value::MakeString("an element weakly referred to", 29);
+    Value elementWeakReference = Value::MakeWeakReference(element);
+    Value array = Value::MakeArray(Value::MakeArray(element));
+    element = Value();
+    array.share();
+    KARINA_CHECK(elementWeakReference.getWeakReference()->isCleared());
+
+    std::thread thread([&object, &otherWeakReference, &array] {
+        KARINA_CHECK(otherWeakReference.getWeakReference()->isCleared());
+        // Released here, with nothing left in this thread's table.
+        object = Value();
+        otherWeakReference = Value();
+        array = Value();
+    });
+    thread.join();
+}
+#endif
+
+} // namespace
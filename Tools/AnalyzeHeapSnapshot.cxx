@@ -0,0 +1,452 @@
+// Reads a snapshot written by Heap::WriteSnapshot() and prints, for the
+// objects retaining the most memory or for the ones whose ids are given,
+// their size, the size of what they dominate and the shortest path to them
+// from a root:
+//
+//     AnalyzeHeapSnapshot <snapshot> [<object id>...]
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../Source/Heap.hxx"
+
+
+namespace {
+
+using Karina::Heap;
+
+
+constexpr unsigned char kTypeCount = 5;
+constexpr std::size_t kTopObjectCount = 20;
+constexpr std::size_t kNone = SIZE_MAX;
+
+
+struct Edge
+{
+    std::size_t index;
+    std::size_t objectId;
+};
+
+
+struct Object
+{
+    unsigned char type;
+    unsigned char flags;
+    std::uint64_t size;
+    std::vector<Edge> edges;
+    bool isWritten;
+};
+
+
+struct Snapshot
+{
+    std::vector<Object> objects;
+    std::vector<std::size_t> rootIds;
+};
+
+
+// The object ids are followed by that of a virtual root, which has an edge
+// to every root.
+struct Analysis
+{
+    std::size_t rootId;
+    // In postorder of a depth-first walk from the virtual root.
+    std::vector<std::size_t> order;
+    std::vector<std::size_t> dominatorIds;
+    std::vector<std::uint64_t> retainedSizes;
+    // Of the shortest paths from the virtual root, and the edges taken.
+    std::vector<std::size_t> parentIds;
+    std::vector<std::size_t> parentIndices;
+};
+
+
+const char *
+GetTypeName(unsigned char type)
+{
+    static const char *const typeNames[] = {
+        "string", "array", "dictionary", "closure", "weak reference",
+    };
+
+    return type < kTypeCount ? typeNames[type] : "unknown";
+}
+
+
+bool
+ReadVarint(std::istream &stream, std::uint64_t *x)
+{
+    *x = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = stream.get();
+
+        if (byte == std::char_traits<char>::eof()) {
+            return false;
+        }
+
+        *x |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+bool
+ReadId(std::istream &stream, Snapshot *snapshot, std::size_t *id)
+{
+    std::uint64_t x;
+
+    // Ids count up from zero, so anything beyond the next one is bogus.
+    if (!ReadVarint(stream, &x) || x > snapshot->objects.size()) {
+        return false;
+    }
+
+    if (x == snapshot->objects.size()) {
+        snapshot->objects.push_back(Object());
+    }
+
+    *id = x;
+    return true;
+}
+
+
+bool
+ReadSnapshot(std::istream &stream, Snapshot *snapshot)
+{
+    char magic[4];
+
+    if (!stream.read(magic, sizeof magic) || std::memcmp(magic, "KHS1", sizeof magic) != 0) {
+        return false;
+    }
+
+    for (;;) {
+        int tag = stream.get();
+        std::size_t id;
+
+        if (tag == Heap::kEndRecord) {
+            break;
+        } else if (tag == Heap::kRootRecord) {
+            if (!ReadId(stream, snapshot, &id)) {
+                return false;
+            }
+
+            snapshot->rootIds.push_back(id);
+        } else if (tag == Heap::kObjectRecord) {
+            if (!ReadId(stream, snapshot, &id) || snapshot->objects[id].isWritten) {
+                return false;
+            }
+
+            int type = stream.get();
+            int flags = stream.get();
+            std::uint64_t size;
+            std::uint64_t edgeCount;
+
+            if (flags == std::char_traits<char>::eof() || !ReadVarint(stream, &size)
+                || !ReadVarint(stream, &edgeCount)) {
+                return false;
+            }
+
+            std::vector<Edge> edges;
+
+            for (std::uint64_t i = 0; i < edgeCount; ++i) {
+                std::uint64_t index;
+                std::size_t objectId;
+
+                if (!ReadVarint(stream, &index) || !ReadId(stream, snapshot, &objectId)) {
+                    return false;
+                }
+
+                edges.push_back({static_cast<std::size_t>(index), objectId});
+            }
+
+            snapshot->objects[id] = {static_cast<unsigned char>(type),
+                                     static_cast<unsigned char>(flags), size, std::move(edges),
+                                     true};
+        } else {
+            return false;
+        }
+    }
+
+    for (const Object &object : snapshot->objects) {
+        if (!object.isWritten) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Calls the function with the id of every object the given one refers to.
+template<class Function>
+void
+ForEachChild(const Snapshot &snapshot, const Analysis &analysis, std::size_t id,
+             Function &&function)
+{
+    if (id == analysis.rootId) {
+        for (std::size_t rootId : snapshot.rootIds) {
+            function(rootId, kNone);
+        }
+    } else {
+        for (const Edge &edge : snapshot.objects[id].edges) {
+            function(edge.objectId, edge.index);
+        }
+    }
+}
+
+
+void
+SortInPostorder(const Snapshot &snapshot, Analysis *analysis)
+{
+    std::vector<bool> isVisited(analysis->rootId + 1, false);
+    // Objects along with the number of their children visited so far.
+    std::vector<std::pair<std::size_t, std::size_t>> stack;
+    isVisited[analysis->rootId] = true;
+    stack.emplace_back(analysis->rootId, 0);
+
+    while (!stack.empty()) {
+        std::size_t id = stack.back().first;
+        std::size_t i = stack.back().second++;
+        std::size_t childCount = id == analysis->rootId ? snapshot.rootIds.size()
+                                                        : snapshot.objects[id].edges.size();
+
+        if (i == childCount) {
+            analysis->order.push_back(id);
+            stack.pop_back();
+            continue;
+        }
+
+        std::size_t childId = id == analysis->rootId ? snapshot.rootIds[i]
+                                                     : snapshot.objects[id].edges[i].objectId;
+
+        if (!isVisited[childId]) {
+            isVisited[childId] = true;
+            stack.emplace_back(childId, 0);
+        }
+    }
+}
+
+
+// Cooper, Harvey and Kennedy's iterative algorithm.
+void
+ComputeDominators(const Snapshot &snapshot, Analysis *analysis)
+{
+    std::size_t idCount = analysis->rootId + 1;
+    std::vector<std::size_t> postorderNumbers(idCount, kNone);
+    std::vector<std::vector<std::size_t>> parentIds(idCount);
+
+    for (std::size_t i = 0; i < analysis->order.size(); ++i) {
+        postorderNumbers[analysis->order[i]] = i;
+    }
+
+    for (std::size_t id = 0; id < idCount; ++id) {
+        ForEachChild(snapshot, *analysis, id, [&] (std::size_t childId, std::size_t) -> void {
+            parentIds[childId].push_back(id);
+        });
+    }
+
+    std::vector<std::size_t> &dominatorIds = analysis->dominatorIds;
+    dominatorIds.assign(idCount, kNone);
+    dominatorIds[analysis->rootId] = analysis->rootId;
+
+    auto intersect = [&] (std::size_t id1, std::size_t id2) -> std::size_t {
+        while (id1 != id2) {
+            while (postorderNumbers[id1] < postorderNumbers[id2]) {
+                id1 = dominatorIds[id1];
+            }
+
+            while (postorderNumbers[id2] < postorderNumbers[id1]) {
+                id2 = dominatorIds[id2];
+            }
+        }
+
+        return id1;
+    };
+
+    for (bool isChanging = true; isChanging;) {
+        isChanging = false;
+
+        // In reverse postorder, skipping the virtual root.
+        for (std::size_t i = analysis->order.size() - 1; i >= 1; --i) {
+            std::size_t id = analysis->order[i - 1];
+            std::size_t dominatorId = kNone;
+
+            for (std::size_t parentId : parentIds[id]) {
+                if (dominatorIds[parentId] != kNone) {
+                    dominatorId = dominatorId == kNone ? parentId
+                                                       : intersect(parentId, dominatorId);
+                }
+            }
+
+            if (dominatorIds[id] != dominatorId) {
+                dominatorIds[id] = dominatorId;
+                isChanging = true;
+            }
+        }
+    }
+}
+
+
+void
+ComputeRetainedSizes(const Snapshot &snapshot, Analysis *analysis)
+{
+    analysis->retainedSizes.assign(analysis->rootId + 1, 0);
+
+    // A dominator comes after everything it dominates in postorder.
+    for (std::size_t id : analysis->order) {
+        if (id != analysis->rootId) {
+            analysis->retainedSizes[id] += snapshot.objects[id].size;
+            analysis->retainedSizes[analysis->dominatorIds[id]] += analysis->retainedSizes[id];
+        }
+    }
+}
+
+
+void
+ComputeShortestPaths(const Snapshot &snapshot, Analysis *analysis)
+{
+    analysis->parentIds.assign(analysis->rootId + 1, kNone);
+    analysis->parentIndices.assign(analysis->rootId + 1, kNone);
+    std::vector<std::size_t> queue = {analysis->rootId};
+    analysis->parentIds[analysis->rootId] = analysis->rootId;
+
+    for (std::size_t i = 0; i < queue.size(); ++i) {
+        std::size_t id = queue[i];
+
+        ForEachChild(snapshot, *analysis, id,
+                     [&] (std::size_t childId, std::size_t index) -> void {
+            if (analysis->parentIds[childId] == kNone) {
+                analysis->parentIds[childId] = id;
+                analysis->parentIndices[childId] = index;
+                queue.push_back(childId);
+            }
+        });
+    }
+}
+
+
+void
+PrintObject(const Snapshot &snapshot, const Analysis &analysis, std::size_t id)
+{
+    const Object &object = snapshot.objects[id];
+    std::printf("#%zu %s%s%s, %llu bytes, retains %llu bytes\n", id, GetTypeName(object.type),
+                (object.flags & Heap::kSnapshotImmortalFlag) != 0 ? " (immortal)" : "",
+                (object.flags & Heap::kSnapshotRegionalFlag) != 0 ? " (regional)" : "",
+                static_cast<unsigned long long>(object.size),
+                static_cast<unsigned long long>(analysis.retainedSizes[id]));
+    std::vector<std::size_t> path;
+
+    if (analysis.parentIds[id] == kNone) {
+        std::printf("    unreachable\n");
+        return;
+    }
+
+    for (std::size_t pathId = id; pathId != analysis.rootId;
+         pathId = analysis.parentIds[pathId]) {
+        path.push_back(pathId);
+    }
+
+    for (std::size_t i = path.size(); i >= 1; --i) {
+        std::size_t pathId = path[i - 1];
+
+        if (i == path.size()) {
+            std::printf("    root");
+        } else {
+            std::printf("    [%zu]", analysis.parentIndices[pathId]);
+        }
+
+        std::printf(" #%zu %s\n", pathId, GetTypeName(snapshot.objects[pathId].type));
+    }
+}
+
+} // namespace
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <snapshot> [<object id>...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::ifstream stream(argv[1], std::ios::binary);
+    Snapshot snapshot;
+
+    if (!stream || !ReadSnapshot(stream, &snapshot)) {
+        std::fprintf(stderr, "%s: cannot read a heap snapshot\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Analysis analysis;
+    analysis.rootId = snapshot.objects.size();
+    SortInPostorder(snapshot, &analysis);
+    ComputeDominators(snapshot, &analysis);
+    ComputeRetainedSizes(snapshot, &analysis);
+    ComputeShortestPaths(snapshot, &analysis);
+    std::size_t counts[kTypeCount] = {};
+    std::uint64_t sizes[kTypeCount] = {};
+
+    for (const Object &object : snapshot.objects) {
+        if (object.type < kTypeCount) {
+            ++counts[object.type];
+            sizes[object.type] += object.size;
+        }
+    }
+
+    std::printf("%zu objects, %zu roots, %llu bytes\n", snapshot.objects.size(),
+                snapshot.rootIds.size(),
+                static_cast<unsigned long long>(analysis.retainedSizes[analysis.rootId]));
+
+    for (unsigned char type = 0; type < kTypeCount; ++type) {
+        std::printf("    %-14s %10zu objects %14llu bytes\n", GetTypeName(type), counts[type],
+                    static_cast<unsigned long long>(sizes[type]));
+    }
+
+    std::vector<std::size_t> ids;
+
+    if (argc >= 3) {
+        for (int i = 2; i < argc; ++i) {
+            char *end;
+            unsigned long long id = std::strtoull(argv[i], &end, 10);
+
+            if (*end != '\0' || id >= snapshot.objects.size()) {
+                std::fprintf(stderr, "%s: no such object\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+
+            ids.push_back(id);
+        }
+    } else {
+        for (std::size_t id = 0; id < snapshot.objects.size(); ++id) {
+            ids.push_back(id);
+        }
+
+        std::size_t topObjectCount = std::min(ids.size(), kTopObjectCount);
+        std::partial_sort(ids.begin(), ids.begin() + topObjectCount, ids.end(),
+                          [&] (std::size_t id1, std::size_t id2) -> bool {
+            return analysis.retainedSizes[id1] > analysis.retainedSizes[id2];
+        });
+
+        ids.resize(topObjectCount);
+    }
+
+    for (std::size_t id : ids) {
+        std::printf("\n");
+        PrintObject(snapshot, analysis, id);
+    }
+
+    return EXIT_SUCCESS;
+}